@@ -0,0 +1,100 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "batch.h"
+
+//----------------------------------------------------------------------
+
+LevelBatch::LevelBatch (const Level& l, unsigned n)
+:_cells()
+,_robot (n)
+,_face (n)
+,_nCrates (n)
+,_moves (n)
+,_crates()
+{
+    for (uint8_t y = 0; y < MAP_HEIGHT; ++y) {
+	for (uint8_t x = 0; x < MAP_WIDTH; ++x) {
+	    auto& c = _cells [Cell (x, y)];
+	    for (auto dir = 0u; dir < 4; ++dir)
+		c |= l.CanMoveTo (x, y, RobotDir(dir)) << dir;
+	    if (l.At(x,y) == DisposePix)
+		c |= CB_Dispose;
+	    else if (l.At(x,y) == ExitPix)
+		c |= CB_Exit;
+	}
+    }
+    for (auto& w : _crates)
+	w.resize (n);
+    for (auto i = 0u; i < n; ++i)
+	Set (i, l);
+}
+
+/// Sets instance i to the robot and crates of l, which must have the same map
+void LevelBatch::Set (unsigned i, const Level& l) noexcept
+{
+    _robot[i] = Cell (l.Robot().x, l.Robot().y);
+    _face[i] = l.Robot().pic - RobotNorthPix;
+    _nCrates[i] = l.Objects().size();
+    _moves[i] = 0;
+    for (auto& w : _crates)
+	w[i] = 0;
+    for (auto& o : l.Objects()) {
+	auto c = Cell (o.x, o.y);
+	_crates[c/64][i] |= 1ull << (c%64);
+    }
+}
+
+/// Moves the robot of each instance i in dirs[i], setting flags[i] to EStepFlag bits
+void LevelBatch::Step (const RobotDir* dirs, uint8_t* flags) noexcept
+{
+    static const int c_Delta[] = { -c_Width, c_Width, 1, -1 };	// Indexed by RobotDir
+    // Stores through uint8_t pointers may alias anything, so the arrays
+    // are loaded here once instead of from the vectors for each instance.
+    auto robots = _robot.data();
+    auto faces = _face.data();
+    auto ncrates = _nCrates.data();
+    auto moves = _moves.data();
+    uint64_t* crates [c_CrateWords];
+    for (auto w = 0u; w < c_CrateWords; ++w)
+	crates[w] = _crates[w].data();
+    for (auto i = 0u, n = size(); i < n; ++i) {
+	// The cell to move to, t, and the one behind it, b, where a pushed crate goes
+	unsigned dir = dirs[i] & 3;
+	int delta = c_Delta[dir];
+	unsigned t = robots[i] + delta, b = t + delta;
+	auto& tword = crates[t/64][i];
+	auto& bword = crates[b/64][i];
+	unsigned crateT = (tword >> (t%64)) & 1;
+	unsigned crateB = (bword >> (b%64)) & 1;
+
+	unsigned canEnter = (_cells[t] >> dir) & 1;
+	unsigned canPush = (_cells[b] >> dir) & 1 & (crateB ^ 1);
+	unsigned moved = canEnter & ((crateT ^ 1) | canPush);
+	unsigned pushed = moved & crateT;
+	unsigned disposed = pushed & !!(_cells[b] & CB_Dispose);
+
+	tword &= ~(uint64_t(pushed) << (t%64));
+	bword |= uint64_t(pushed & (disposed ^ 1)) << (b%64);
+	robots[i] += int(moved) * delta;
+	faces[i] = dir;
+	ncrates[i] -= disposed;
+	moves[i] += moved;
+	unsigned finished = !ncrates[i] & !!(_cells[robots[i]] & CB_Exit);
+	flags[i] = moved*SF_Moved | pushed*SF_Pushed | disposed*SF_Disposed | finished*SF_Finished;
+    }
+}
+
+/// Packs instance i the same way as Level::Pack
+void LevelBatch::Pack (unsigned i, Level::Packed& p) const noexcept
+{
+    memset (&p, 0, sizeof(p));
+    p.robot = RobotY(i)*MAP_WIDTH + RobotX(i);
+    for (auto w = 0u; w < c_CrateWords; ++w) {
+	for (auto bits = _crates[w][i]; bits; bits &= bits-1) {
+	    auto c = w*64 + __builtin_ctzll (bits);
+	    auto lc = (c/c_Width - c_Border)*MAP_WIDTH + c%c_Width - c_Border;
+	    p.crates[lc/8] |= 1<<(lc%8);
+	}
+    }
+}
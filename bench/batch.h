@@ -0,0 +1,59 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#pragma once
+#include "../level.h"
+
+//----------------------------------------------------------------------
+
+/// Many instances of one level, stepped together.
+///
+/// For rollouts, where thousands of games on the same map are played
+/// at once. State is kept as one array per field, indexed by instance,
+/// with crates as bitplanes of the map, and Step has no data dependent
+/// branches. The map is surrounded by walls, so moves need no bounds
+/// checks. The results of each step, and the robot and crate positions
+/// after it, are the same as those of Level::MoveRobot. Crate pics are
+/// not kept.
+class LevelBatch {
+public:
+    enum EStepFlag : uint8_t {
+	SF_Moved	= 1,
+	SF_Pushed	= 2,
+	SF_Disposed	= 4,
+	SF_Finished	= 8
+    };
+    enum {
+	c_Border	= 2,	///< Wall cells on each side of the map, enough for a push off the edge
+	c_Width		= MAP_WIDTH + 2*c_Border,
+	c_Cells		= (MAP_HEIGHT + 2*c_Border) * c_Width,
+	c_CrateWords	= (c_Cells+63)/64
+    };
+public:
+			LevelBatch (const Level& l, unsigned n);
+    inline unsigned	size (void) const		{ return _robot.size(); }
+    inline uint8_t	RobotX (unsigned i) const	{ return _robot[i] % c_Width - c_Border; }
+    inline uint8_t	RobotY (unsigned i) const	{ return _robot[i] / c_Width - c_Border; }
+    inline RobotDir	Facing (unsigned i) const	{ return RobotDir (_face[i]); }
+    inline unsigned	Crates (unsigned i) const	{ return _nCrates[i]; }
+    inline uint32_t	Moves (unsigned i) const	{ return _moves[i]; }
+    inline bool		IsCrateAt (unsigned i, uint8_t x, uint8_t y) const	{ auto c = Cell (x, y); return (_crates[c/64][i] >> (c%64)) & 1; }
+    void		Set (unsigned i, const Level& l) noexcept;
+    void		Step (const RobotDir* dirs, uint8_t* flags) noexcept;
+    void		Pack (unsigned i, Level::Packed& p) const noexcept;
+private:
+    static inline unsigned Cell (uint8_t x, uint8_t y)	{ return (y+c_Border)*c_Width + x+c_Border; }
+private:
+    /// Bits of _cells: one per direction the cell can be entered from, and the cell type
+    enum {
+	CB_Dispose	= 1<<4,
+	CB_Exit		= 1<<5
+    };
+private:
+    uint8_t		_cells [c_Cells];
+    vector<uint16_t>	_robot;		///< Cell index
+    vector<uint8_t>	_face;
+    vector<uint8_t>	_nCrates;
+    vector<uint32_t>	_moves;
+    vector<uint64_t>	_crates [c_CrateWords];	///< Bit per cell, one array per word of the map
+};
@@ -0,0 +1,123 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+//
+// Level microbenchmarks. Each line of output is the benchmark name and
+// the best time per operation out of c_Runs runs of a fixed workload.
+// With -s, runs the Level invariant stress test instead.
+
+#include "bench.h"
+#include <unistd.h>
+#include "../data/levels.txt"
+
+//----------------------------------------------------------------------
+
+enum { c_Runs = 5 };
+
+/// Keeps the compiler from optimizing away the computation of v
+template <typename T>
+static inline void Consume (const T& v) noexcept
+{
+    asm volatile ("" : : "g"(&v) : "memory");
+}
+
+/// Runs f c_Runs times and prints the best time per op
+template <typename F>
+static void Bench (const char* name, unsigned ops, F f)
+{
+    auto best = UINT64_MAX;
+    for (auto r = 0u; r < c_Runs; ++r) {
+	auto t0 = NowNS();
+	f();
+	best = min (best, NowNS() - t0);
+    }
+    printf ("%-24s %12.2f ns/op\n", name, double(best)/ops);
+}
+
+//----------------------------------------------------------------------
+
+int main (int argc, char* const* argv)
+{
+    auto levels = Level::LoadAll (levels_data);
+    for (int opt; 0 < (opt = getopt (argc, argv, "s:"));) {
+	if (opt == 's')				// -s seconds: stress test
+	    return Stress (levels, atoi (optarg));
+	printf ("Usage: %s [-s seconds]\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    enum { c_LoadIters = 2000 };
+    Bench ("level/load", c_LoadIters*levels.size(), [&]{
+	Level l;
+	for (auto i = 0u; i < c_LoadIters; ++i) {
+	    for (auto ldata = levels_data; ldata;)
+		ldata = l.Load (ldata);
+	    Consume (l);
+	}
+    });
+
+    enum { c_CopyIters = 1000000 };
+    Bench ("level/copy", c_CopyIters, [&]{
+	Level l;
+	for (auto i = 0u; i < c_CopyIters; ++i) {
+	    l = levels [i % levels.size()];
+	    Consume (l);
+	}
+    });
+
+    for (auto li = 0u; li < levels.size(); ++li) {
+	const auto& l0 = levels[li];
+	char name [32];
+
+	// Random walks, restarted every 1000 moves to keep crates in play
+	enum { c_MoveIters = 1000000, c_MovesPerWalk = 1000 };
+	snprintf (name, sizeof(name), "level%02u/MoveRobot", li+1);
+	Bench (name, c_MoveIters, [&]{
+	    uint64_t seed = 1;
+	    Level l;
+	    for (auto i = 0u; i < c_MoveIters; ++i) {
+		if (!(i % c_MovesPerWalk))
+		    l = l0;
+		l.MoveRobot (RobotDir (Random(seed) % 4));
+	    }
+	    Consume (l);
+	});
+
+	// The same number of moves as c_BatchSize walks in lockstep
+	enum { c_BatchSize = c_MoveIters / c_MovesPerWalk };
+	snprintf (name, sizeof(name), "level%02u/BatchStep", li+1);
+	Bench (name, c_MoveIters, [&]{
+	    uint64_t seed = 1;
+	    LevelBatch batch (l0, c_BatchSize);
+	    RobotDir dirs [c_BatchSize];
+	    uint8_t flags [c_BatchSize];
+	    for (auto i = 0u; i < c_MovesPerWalk; ++i) {
+		for (auto& dir : dirs)
+		    dir = RobotDir (Random(seed) % 4);
+		batch.Step (dirs, flags);
+	    }
+	    Consume (batch);
+	});
+
+	enum { c_CellIters = 5000 };
+	snprintf (name, sizeof(name), "level%02u/FindCrate", li+1);
+	Bench (name, c_CellIters*MAP_SIZE, [&]{
+	    auto n = 0u;
+	    for (auto i = 0u; i < c_CellIters; ++i)
+		for (auto y = 0u; y < MAP_HEIGHT; ++y)
+		    for (auto x = 0u; x < MAP_WIDTH; ++x)
+			n += l0.IsCrateAt (x, y);
+	    Consume (n);
+	});
+
+	snprintf (name, sizeof(name), "level%02u/CanMoveTo", li+1);
+	Bench (name, c_CellIters*MAP_SIZE, [&]{
+	    auto n = 0u;
+	    for (auto i = 0u; i < c_CellIters; ++i)
+		for (auto y = 0u; y < MAP_HEIGHT; ++y)
+		    for (auto x = 0u; x < MAP_WIDTH; ++x)
+			n += l0.CanMoveTo (x, y, RobotDir (i % 4));
+	    Consume (n);
+	});
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,25 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#pragma once
+#include "../level.h"
+#include "batch.h"
+#include <time.h>
+
+//----------------------------------------------------------------------
+
+inline uint64_t NowNS (void) noexcept
+{
+    timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+
+/// Fixed seed generator, so every run makes the same moves
+inline uint32_t Random (uint64_t& seed) noexcept
+{
+    seed = seed*6364136223846793005ull + 1442695040888963407ull;
+    return seed >> 33;
+}
+
+int Stress (const vector<Level>& levels, unsigned seconds);
@@ -0,0 +1,134 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+//
+// Randomized stress test of Level invariants. Random walks are made on
+// every built-in level, with Level::Verify and move rules checked after
+// each step. A failing walk is shrunk to a minimal move string. Walks
+// are also made with LevelBatch and compared to Level::MoveRobot.
+
+#include "bench.h"
+#include <string>
+
+//----------------------------------------------------------------------
+
+enum { c_WalkLength = 256, c_BatchSize = 64 };
+
+static const int8_t c_DirDX[] = { 0, 0, 1, -1 };
+static const int8_t c_DirDY[] = { -1, 1, 0, 0 };
+
+/// Makes one move in l and checks it. Returns the broken rule or nullptr.
+static const char* Step (Level& l, RobotDir dir) noexcept
+{
+    auto ox = l.Robot().x, oy = l.Robot().y;
+    auto ncrates = l.Objects().size();
+    Level::MoveDelta d;
+    auto moved = l.MoveRobot (dir, &d);
+    auto& r = l.Robot();
+    if (!moved) {
+	if (r.x != ox || r.y != oy)
+	    return "robot moved when MoveRobot failed";
+	if (l.Objects().size() != ncrates)
+	    return "crate removed when MoveRobot failed";
+    } else {
+	if (r.x != uint8_t(ox + c_DirDX[dir]) || r.y != uint8_t(oy + c_DirDY[dir]))
+	    return "robot moved to the wrong cell";
+	auto pic = l.At (r.x, r.y);
+	if (pic >= OWDNorthPix && pic <= OWDWestPix && pic - OWDNorthPix != dir)
+	    return "one-way door entered against its direction";
+	if (l.Objects().size() != ncrates - d.disposed)
+	    return "crate count changed without disposal";
+	if (d.disposed && l.At (r.x + c_DirDX[dir], r.y + c_DirDY[dir]) != DisposePix)
+	    return "crate removed outside a recycling bin";
+    }
+    if (l.Finished() != (l.Objects().empty() && l.At (r.x, r.y) == ExitPix))
+	return "Finished does not match the level";
+    return l.Verify();
+}
+
+/// Replays moves from l0, returning the first failure or nullptr.
+static const char* Replay (const Level& l0, const string& moves) noexcept
+{
+    auto l = l0;
+    for (auto c : moves)
+	if (auto err = Step (l, RobotDir (strchr (c_RobotDirChars, c) - c_RobotDirChars)))
+	    return err;
+    return nullptr;
+}
+
+/// Removes moves from a failing sequence while it still fails
+static string Shrink (const Level& l0, string moves)
+{
+    for (auto chunk = moves.size()/2; chunk; chunk /= 2)
+	for (auto i = 0u; i + chunk <= moves.size();) {
+	    auto shorter = moves;
+	    shorter.erase (i, chunk);
+	    if (Replay (l0, shorter))
+		moves = shorter;
+	    else
+		i += chunk;
+	}
+    return moves;
+}
+
+/// Steps c_BatchSize random walks in a LevelBatch and in Levels, returning the first difference or nullptr
+static const char* CheckBatch (const Level& l0, uint64_t& seed)
+{
+    LevelBatch batch (l0, c_BatchSize);
+    vector<Level> levels (c_BatchSize, l0);
+    RobotDir dirs [c_BatchSize];
+    uint8_t flags [c_BatchSize];
+    for (auto step = 0u; step < c_WalkLength; ++step) {
+	for (auto& dir : dirs)
+	    dir = RobotDir (Random(seed) % 4);
+	batch.Step (dirs, flags);
+	for (auto i = 0u; i < c_BatchSize; ++i) {
+	    auto& l = levels[i];
+	    Level::MoveDelta d = {};
+	    unsigned moved = l.MoveRobot (dirs[i], &d);
+	    unsigned expected = moved*LevelBatch::SF_Moved | d.pushed*LevelBatch::SF_Pushed
+			| d.disposed*LevelBatch::SF_Disposed | l.Finished()*LevelBatch::SF_Finished;
+	    if (flags[i] != expected)
+		return "batch step flags differ from MoveRobot";
+	    Level::Packed lp, bp;
+	    l.Pack (lp);
+	    batch.Pack (i, bp);
+	    if (lp != bp || batch.Facing(i) != l.Robot().pic - RobotNorthPix)
+		return "batch robot or crates differ from MoveRobot";
+	}
+    }
+    return nullptr;
+}
+
+//----------------------------------------------------------------------
+
+int Stress (const vector<Level>& levels, unsigned seconds)
+{
+    uint64_t seed = 1, nmoves = 0;
+    RobotDir walk [c_WalkLength];
+    uint64_t t0 = NowNS(), tend = t0 + seconds*1000000000ull;
+    do {
+	for (auto li = 0u; li < levels.size(); ++li) {
+	    auto l = levels[li];
+	    for (auto i = 0u; i < size(walk); ++i) {
+		walk[i] = RobotDir (Random(seed) % 4);
+		if (Step (l, walk[i])) {
+		    string moves;
+		    for (auto j = 0u; j <= i; ++j)
+			moves += c_RobotDirChars[walk[j]];
+		    moves = Shrink (levels[li], moves);
+		    printf ("stress: level %u: %s after moves %s\n", li+1, Replay (levels[li], moves), moves.c_str());
+		    return EXIT_FAILURE;
+		}
+	    }
+	    nmoves += size(walk);
+	    if (auto err = CheckBatch (levels[li], seed)) {
+		printf ("stress: level %u: %s\n", li+1, err);
+		return EXIT_FAILURE;
+	    }
+	    nmoves += c_WalkLength*c_BatchSize;
+	}
+    } while (NowNS() < tend);
+    auto t = NowNS() - t0;
+    printf ("stress: %llu moves, %.2f M moves/s, ok\n", (unsigned long long) nmoves, nmoves*1000./t);
+    return EXIT_SUCCESS;
+}
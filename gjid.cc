@@ -2,7 +2,8 @@
 // This file is free software, distributed under the MIT License.
 
 #include "gjid.h"
-#include <time.h>
+#include <unistd.h>
+#include <limits.h>
 
 //{{{ Game data --------------------------------------------------------
 
@@ -55,27 +56,202 @@ GJID::GJID (void)
 ,_storyPage (0)
 ,_level (0)
 ,_moves (0)
+,_undoPos (0)
+,_keylogMode (keylog_None)
+,_keylogFile (nullptr)
+,_replayPos (0)
+,_startTime (0)
+,_traceFile (nullptr)
+,_showStats (false)
+,_benchmark (false)
+,_keylog()
 ,_imgtiles()
 ,_imglogo()
 ,_curLevel()
+,_journal()
+,_path()
+,_pushBuffers()
+,_walkDist()
 ,_levels()
 {
 }
 
-int GJID::Run (void)
+int GJID::Run (int argc, const char* const* argv)
 {
+    const char* replayFile = nullptr;
+    auto fast = false, badargs = false;
+    for (int opt; 0 < (opt = getopt (argc, const_cast<char* const*>(argv), "r:p:fst:b"));) {
+	if (opt == 'r')				// -r file: record keys to file
+	    _keylogFile = optarg;
+	else if (opt == 'p')			// -p file: replay keys from file
+	    replayFile = optarg;
+	else if (opt == 'f')
+	    fast = true;			// -f: replay without a window as fast as possible
+	else if (opt == 's')
+	    _showStats = true;			// -s: show X request stats, print them as JSON on exit
+	else if (opt == 't')
+	    _traceFile = optarg;		// -t file: write key to screen latency trace to file
+	else if (opt == 'b')
+	    _benchmark = true;			// -b: run drawing benchmarks and exit
+	else
+	    badargs = true;
+    }
+    // Options may come in any order, so the key log mode is set afterwards
+    if (badargs || optind != argc || (_keylogFile && replayFile) || (fast && !replayFile)) {
+	printf ("Usage: %s [-b] [-s] [-t trace.json] [-r keylog | -p keylog [-f]]\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+    if (_keylogFile)
+	_keylogMode = keylog_Record;
+    else if (replayFile) {
+	_keylogMode = fast ? keylog_ReplayFast : keylog_Replay;
+	_keylog.Read (replayFile);
+    }
+
+    _levels = Level::LoadAll (levels_data);	// levels.txt
+    _curLevel = _levels[0];			// Moving crates changes level data, so make a working copy
+
+    // Key logs always start from a new game
+    if (_keylogMode == keylog_None && !_benchmark)
+	RestoreGame();
+    _curLevel.WalkDistances (_walkDist);
+
+    // Fast replay is headless; without an X connection Update does not draw
+    if (_keylogMode == keylog_ReplayFast) {
+	auto t0 = NowMS();
+	for (const auto& e : _keylog.Entries())
+	    DispatchKey (e.key);
+	_replayPos = _keylog.Entries().size();
+	printf ("Replayed in %u ms\n", unsigned(NowMS()-t0));
+	return CheckReplay();
+    }
+
+    Connect();
     CreateWindow ("GJID", 320, 240);
 
     _imgtiles = LoadImage (tileset_xpm);	// Map tiles and objects
     _imglogo = LoadImage (logo_xpm);		// Big text for the story
+    if (_benchmark)
+	return Benchmark();
 
-    for (auto ldata = levels_data; ldata;) {	// levels.txt
-	_levels.push_back (Level());
-	ldata = _levels.back().Load (ldata);
+    if (_traceFile)
+	StartTrace();
+    _startTime = NowMS();
+    if (_keylogMode == keylog_Replay && !_keylog.Entries().empty())
+	SetTimer (_keylog.Entries()[0].ms);
+
+    auto r = CXApp::Run();
+    if (_showStats)
+	WriteStats (stdout);
+    if (_traceFile) {
+	auto f = fopen (_traceFile, "w");
+	if (!f)
+	    throw runtime_error ("unable to create trace file");
+	WriteTrace (f);
+	fclose (f);
+	PrintLatency ("KeyPress");
     }
-    _curLevel = _levels[0];			// Moving crates changes level data, so make a working copy
+    if (_keylogMode == keylog_None)
+	SaveGame();
+    else if (_keylogMode == keylog_Record) {
+	_keylog.SetResult (_level, _moves);
+	_keylog.Write (_keylogFile);
+    } else if (_keylogMode == keylog_Replay)
+	r = CheckReplay();
+    return r;
+}
+
+//----------------------------------------------------------------------
+// Saved game
+
+namespace {
+
+/// Snapshot of the game state, written on exit and restored on startup
+struct SSavedGame {
+    enum { c_Magic = 0x56414a47, c_Version = 1 };	// "GJAV"
+    uint32_t	magic;
+    uint16_t	version;
+    uint16_t	size;		///< sizeof(SSavedGame), to reject files from builds with a different Level
+    uint32_t	checksum;	///< Of everything after this field
+    uint8_t	state;
+    uint8_t	storyPage;
+    uint16_t	level;
+    uint32_t	moves;
+    Level	curLevel;
+    uint32_t	Checksum (void) const noexcept;
+};
+
+// FNV-1a is plenty to catch a truncated or corrupt file
+uint32_t SSavedGame::Checksum (void) const noexcept
+{
+    auto h = 2166136261u;
+    for (auto p = reinterpret_cast<const uint8_t*>(&state); p < reinterpret_cast<const uint8_t*>(this+1); ++p)
+	h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+bool SavedGamePath (char* buf, size_t bufsz) noexcept
+{
+    auto home = getenv ("HOME");
+    return home && size_t(snprintf (buf, bufsz, "%s/.gjid.sav", home)) < bufsz;
+}
+
+} // namespace
+
+void GJID::SaveGame (void) const noexcept
+{
+    char path [PATH_MAX];
+    if (!SavedGamePath (path, sizeof(path)))
+	return;
+    if (_state == state_Winner) {	// nothing left to resume
+	unlink (path);
+	return;
+    }
+    SSavedGame sg = {};
+    sg.magic = SSavedGame::c_Magic;
+    sg.version = SSavedGame::c_Version;
+    sg.size = sizeof(sg);
+    sg.state = _state == state_Loser ? state_Game : _state;	// F10 quits, but should not lose the level
+    sg.storyPage = _storyPage;
+    sg.level = _level;
+    sg.moves = _moves;
+    sg.curLevel = _curLevel;
+    sg.checksum = sg.Checksum();
+    // Written to a temporary file and renamed, so a failed write keeps the previous save
+    char tmppath [PATH_MAX];
+    if (size_t(snprintf (tmppath, sizeof(tmppath), "%s.tmp", path)) >= sizeof(tmppath))
+	return;
+    auto f = fopen (tmppath, "wb");
+    if (!f)
+	return;
+    auto ok = fwrite (&sg, sizeof(sg), 1, f) == 1;
+    ok &= !fflush (f) && !fsync (fileno (f));
+    ok &= !fclose (f);
+    if (!ok || rename (tmppath, path))
+	unlink (tmppath);
+}
 
-    return CXApp::Run();
+// On any error the game silently starts from the beginning
+void GJID::RestoreGame (void) noexcept
+{
+    char path [PATH_MAX];
+    if (!SavedGamePath (path, sizeof(path)))
+	return;
+    auto f = fopen (path, "rb");
+    if (!f)
+	return;
+    SSavedGame sg;
+    auto ok = fread (&sg, sizeof(sg), 1, f) == 1;
+    fclose (f);
+    if (!ok || sg.magic != SSavedGame::c_Magic || sg.version != SSavedGame::c_Version || sg.size != sizeof(sg)
+	    || sg.checksum != sg.Checksum() || sg.state >= state_Last || sg.storyPage > 2 || sg.level >= _levels.size()
+	    || sg.curLevel.Verify())
+	return;
+    _state = EGameState (sg.state);
+    _storyPage = sg.storyPage;
+    _level = sg.level;
+    _moves = sg.moves;
+    _curLevel = sg.curLevel;
 }
 
 //----------------------------------------------------------------------
@@ -148,7 +324,10 @@ inline void GJID::PrintStory (void)
 	    "levels for you to clear.\0"
 	    " \0"
 	    "     Controls:   Cursor keys to move\0"
+	    "                 Click to walk or push a crate\0"
 	    "                 F1  show this help\0"
+	    "                 U   undo a move\0"
+	    "                 R   redo a move\0"
 	    "                 F6  restart the level\0"
 	    "                 F8  skip the level\0"
 	    "                 F10 quit the game\0"
@@ -171,9 +350,9 @@ inline void GJID::PrintStory (void)
 
 inline void GJID::DrawLevel (void)
 {
-    auto it (_curLevel.Map().begin());
+    auto it (begin(_curLevel.Map()));
     // Fill with default background
-    FillWithTile (PicIndex(_curLevel.Map().back()));
+    FillWithTile (PicIndex(_curLevel.Map()[MAP_SIZE-1]));
     // Map tiles on top of that (map is shorter than the screen)
     for (auto y = 0u; y < MAP_HEIGHT*TILE_H; y += TILE_H) {
 	for (auto x = 0u; x < MAP_WIDTH*TILE_W; x += TILE_W) {
@@ -193,6 +372,18 @@ inline void GJID::DrawLevel (void)
 	snprintf (mbuf, sizeof(mbuf), "Moves: %u", _moves);
 	DrawText (TILE_W*17+TILE_W/4, Height()-TILE_H*2/3, mbuf, RGB(128,128,0));
     }
+    // X request counts of the previous frame
+    if (_showStats) {
+	auto& fs = FrameStats();
+	auto nreq = 0u, nbytes = 0u;
+	for (auto k = 0u; k < size(fs.requests); ++k) {
+	    nreq += fs.requests[k];
+	    nbytes += fs.bytes[k];
+	}
+	char sbuf [64];
+	snprintf (sbuf, sizeof(sbuf), "X: %u req %u bytes %u rt %u us", nreq, nbytes, fs.roundTrips, fs.drawTime);
+	DrawText (TILE_W/4, Height()-TILE_H*2/3, sbuf, RGB(128,128,0));
+    }
 }
 
 void GJID::OnDraw (void)
@@ -227,37 +418,97 @@ void GJID::StoryKeys (key_t key)
     Update();
 }
 
+void GJID::RestartLevel (void)
+{
+    _curLevel = _levels [_level];
+    _journal.clear();
+    _undoPos = 0;
+}
+
+// Each move is journaled in one byte for unlimited undo.
+void GJID::MoveRobot (RobotDir where)
+{
+    Level::MoveDelta d;
+    {
+	CTraceSpan span (*this, "MoveRobot");
+	if (!_curLevel.MoveRobot (where, &d))
+	    return;
+    }
+    _journal.resize (_undoPos);	// a new move discards the redo history
+    _journal.push_back (d);
+    ++_undoPos;
+    ++_moves;
+}
+
+void GJID::UndoMove (void)
+{
+    if (!_undoPos)
+	return;
+    _curLevel.UndoMove (_journal [--_undoPos]);
+    _moves -= !!_moves;
+}
+
+// Redo replays the move rather than storing the resulting state
+void GJID::RedoMove (void)
+{
+    if (_undoPos >= _journal.size())
+	return;
+    _curLevel.MoveRobot (RobotDir (_journal [_undoPos++].dir));
+    ++_moves;
+}
+
+// Walks to the clicked cell, or pushes the clicked crate into the nearest
+// recycling bin. All the moves are made before the single redraw.
+void GJID::ClickCell (unsigned cell)
+{
+    uint8_t x = cell % MAP_WIDTH, y = cell / MAP_WIDTH;
+    if (_curLevel.IsCrateAt (x, y))
+	_curLevel.PushPath (x, y, _path, _pushBuffers);
+    else
+	_curLevel.WalkPath (_walkDist, x, y, _path);
+    for (auto i = 0u; i < _path.size() && !_curLevel.Finished(); ++i)
+	MoveRobot (_path[i]);
+}
+
 void GJID::LevelKeys (key_t key)
 {
     switch (key) {
 	case 'k':
-	case XK_Up:	_moves += _curLevel.MoveRobot (North);	break;
+	case XK_Up:	MoveRobot (North);			break;
 	case 'j':
-	case XK_Down:	_moves += _curLevel.MoveRobot (South);	break;
+	case XK_Down:	MoveRobot (South);			break;
 	case 'l':
-	case XK_Right:	_moves += _curLevel.MoveRobot (East);	break;
+	case XK_Right:	MoveRobot (East);			break;
 	case 'h':
-	case XK_Left:	_moves += _curLevel.MoveRobot (West);	break;
+	case XK_Left:	MoveRobot (West);			break;
+	case 'u':
+	case XK_BackSpace: UndoMove();				break;
+	case 'r':	RedoMove();				break;
 	case XK_F1:	GoToState (state_Story);		break;
 	case 'q':
 	case XK_Escape:	Quit();					break;
 	case XK_F10:	GoToState (state_Loser);		break;
 	case XK_F8:	_level = (_level + 1) % _levels.size();	// fallthrough
-	case XK_F6:	_curLevel = _levels [_level];		break;
+	case XK_F6:	RestartLevel();				break;
+	default:	if (unsigned(key - XKM_ClickCell) < MAP_SIZE)
+			    ClickCell (key - XKM_ClickCell);
+			break;
     }
     if (_curLevel.Finished()) {
 	_moves = 0;
 	if (++_level < _levels.size())
-	    _curLevel = _levels [_level];
+	    RestartLevel();
 	else {
 	    _level = 0;
 	    GoToState (state_Winner);
 	}
     }
+    // Once per key rather than per move, since a click makes many moves
+    _curLevel.WalkDistances (_walkDist);
     Update();
 }
 
-void GJID::OnKey (key_t key)
+void GJID::DispatchKey (key_t key)
 {
     switch (_state) {
 	default:
@@ -268,3 +519,93 @@ void GJID::OnKey (key_t key)
 	case state_Loser:	return Quit();
     }
 }
+
+void GJID::OnKey (key_t key)
+{
+    if (_keylogMode == keylog_Record)
+	_keylog.Record (NowMS() - _startTime, key);
+    else if (_keylogMode == keylog_Replay)
+	return;		// Only replayed keys are processed
+    DispatchKey (key);
+}
+
+void GJID::OnButton (bidx_t b, int x, int y)
+{
+    if (b != 1)
+	return;
+    if (_state != state_Game)
+	OnKey (XK_Return);	// same as any key
+    else if (unsigned(x) < MAP_WIDTH*TILE_W && unsigned(y) < MAP_HEIGHT*TILE_H)
+	OnKey (XKM_ClickCell + y/TILE_H*MAP_WIDTH + x/TILE_W);	// as a key, to be recorded in the key log
+}
+
+//----------------------------------------------------------------------
+// Drawing benchmarks, run by make bench
+
+// Each result is the best of several runs, waiting for the server to
+// finish, in the same format as the Level benchmarks in bench/bench.cc
+int GJID::Benchmark (void)
+{
+    enum { c_Runs = 5, c_LoadIters = 20, c_FrameIters = 200 };
+    auto bench = [this](const char* name, unsigned ops, auto f) {
+	auto best = UINT64_MAX;
+	for (auto r = 0u; r < c_Runs; ++r) {
+	    Sync();
+	    auto t0 = NowUS();
+	    for (auto i = 0u; i < ops; ++i)
+		f();
+	    Sync();
+	    best = min (best, NowUS() - t0);
+	}
+	printf ("%-24s %12.2f ns/op\n", name, best*1000./ops);
+    };
+    // Each load is paired with a free, so the server does not accumulate resources
+    bench ("xapp/LoadImage", c_LoadIters, [this]{ FreeImage (LoadImage (tileset_xpm)); });
+    bench ("xapp/LoadFont", c_LoadIters, [this]{ LoadFont(); FreeFont(); });
+    LoadFont();		// for the draw benchmarks, since the window is never mapped
+
+    static const struct {
+	EGameState	state;
+	uint8_t		storyPage;
+	const char	name [22];
+    } c_Screens[] = {
+	{ state_Title,	0, "draw/title" },
+	{ state_Story,	0, "draw/story1" },
+	{ state_Story,	1, "draw/story2" },
+	{ state_Story,	2, "draw/story3" },
+	{ state_Game,	0, "draw/game" },
+	{ state_Winner,	0, "draw/winner" },
+	{ state_Loser,	0, "draw/loser" }
+    };
+    _moves = 1;		// to draw the move counter
+    for (const auto& s : c_Screens) {
+	_state = s.state;
+	_storyPage = s.storyPage;
+	bench (s.name, c_FrameIters, [this]{ Update(); });
+    }
+    return EXIT_SUCCESS;
+}
+
+//----------------------------------------------------------------------
+// Key log replay
+
+void GJID::OnTimer (void)
+{
+    const auto& keys = _keylog.Entries();
+    auto elapsed = NowMS() - _startTime;
+    while (_replayPos < keys.size() && keys[_replayPos].ms <= elapsed)
+	DispatchKey (keys[_replayPos++].key);
+    if (_replayPos < keys.size())
+	SetTimer (keys[_replayPos].ms - elapsed);
+}
+
+// Verifies that replay reached the same result as the recorded session
+int GJID::CheckReplay (void) const
+{
+    printf ("Replayed %u of %zu keys: level %u, %u moves\n", _replayPos, _keylog.Entries().size(), _level, _moves);
+    if (_replayPos != _keylog.Entries().size() || _level != _keylog.Level() || _moves != _keylog.Moves()) {
+	printf ("Error: replay diverged from the recorded level %u, %u moves\n", _keylog.Level(), _keylog.Moves());
+	return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
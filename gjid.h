@@ -3,6 +3,7 @@
 
 #pragma once
 #include "level.h"
+#include "keylog.h"
 #include "xapp.h"
 
 //----------------------------------------------------------------------
@@ -16,13 +17,22 @@ class GJID : public CXApp {
 	state_Loser,
 	state_Last
     };
+    enum EKeyLogMode {
+	keylog_None,
+	keylog_Record,
+	keylog_Replay,
+	keylog_ReplayFast
+    };
+    enum { XKM_ClickCell = 16<<_XKM_Bitshift };	///< Pseudo-key for a map click, plus the cell index
 public:
     static GJID&	Instance (void)	{ static GJID s_App; return s_App; }
-    int			Run (void);
+    int			Run (int argc, const char* const* argv);
 protected:
 			GJID (void);
     virtual void	OnDraw (void) override;
     virtual void	OnKey (key_t key) override;
+    virtual void	OnButton (bidx_t b, int x, int y) override;
+    virtual void	OnTimer (void) override;
 private:
     inline void		PutTile (PicIndex tidx, int x, int y)	{ DrawImageTile (_imgtiles, c_Tiles[tidx], x, y); }
     inline void		GoToState (EGameState state)		{ _state = state; Update(); }
@@ -33,14 +43,37 @@ private:
     inline void		TitleKeys (key_t key);
     inline void		StoryKeys (key_t key);
     inline void		LevelKeys (key_t key);
+    void		DispatchKey (key_t key);
+    void		SaveGame (void) const noexcept;
+    void		RestoreGame (void) noexcept;
+    int			CheckReplay (void) const;
+    int			Benchmark (void);
+    inline void		RestartLevel (void);
+    inline void		MoveRobot (RobotDir where);
+    inline void		UndoMove (void);
+    inline void		RedoMove (void);
+    inline void		ClickCell (unsigned cell);
 private:
     EGameState		_state;
     uint32_t		_storyPage;
     uint32_t		_level;
     uint32_t		_moves;
+    uint32_t		_undoPos;	///< Moves in _journal before this can be undone, after it redone
+    EKeyLogMode		_keylogMode;
+    const char*		_keylogFile;
+    uint32_t		_replayPos;	///< Next _keylog entry to replay
+    uint64_t		_startTime;	///< NowMS at session start, for key log timestamps
+    const char*		_traceFile;	///< Chrome trace output, when tracing
+    bool		_showStats;	///< Draw X request counts and write them out on exit
+    bool		_benchmark;	///< Time drawing instead of playing
+    KeyLog		_keylog;
     SImage		_imgtiles;
     SImage		_imglogo;
     Level		_curLevel;
+    vector<Level::MoveDelta> _journal;
+    Level::pathvec_t	_path;
+    Level::PushBuffers	_pushBuffers;
+    Level::distmap_t	_walkDist;	///< Level::WalkDistances of _curLevel, updated after each key
     vector<Level>	_levels;
     static const SImageTile c_Tiles [NumberOfPics];
 };
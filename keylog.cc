@@ -0,0 +1,51 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#include "keylog.h"
+#include <sys/stat.h>
+
+//----------------------------------------------------------------------
+
+KeyLog::KeyLog (void)
+:_entries()
+,_level (0)
+,_moves (0)
+{
+}
+
+void KeyLog::Read (const char* filename)
+{
+    auto f = fopen (filename, "rb");
+    if (!f)
+	throw runtime_error ("unable to open key log");
+    Header h;
+    auto ok = fread (&h, sizeof(h), 1, f) == 1 && !memcmp (h.magic, c_Magic, sizeof(h.magic)) && h.version == c_Version;
+    // The entry count is checked against the file size before allocating
+    struct stat st;
+    ok = ok && !fstat (fileno (f), &st) && h.nEntries <= (st.st_size - sizeof(h)) / sizeof(Entry);
+    if (ok) {
+	_entries.resize (h.nEntries);
+	ok = fread (_entries.data(), sizeof(Entry), h.nEntries, f) == h.nEntries;
+	SetResult (h.level, h.moves);
+    }
+    fclose (f);
+    if (!ok)
+	throw runtime_error ("invalid key log");
+}
+
+void KeyLog::Write (const char* filename) const
+{
+    auto f = fopen (filename, "wb");
+    if (!f)
+	throw runtime_error ("unable to create key log");
+    Header h;
+    memcpy (h.magic, c_Magic, sizeof(h.magic));
+    h.version = c_Version;
+    h.level = _level;
+    h.moves = _moves;
+    h.nEntries = _entries.size();
+    auto ok = fwrite (&h, sizeof(h), 1, f) == 1
+	    && fwrite (_entries.data(), sizeof(Entry), _entries.size(), f) == _entries.size();
+    if (fclose (f) || !ok)
+	throw runtime_error ("unable to write key log");
+}
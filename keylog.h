@@ -0,0 +1,42 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+
+#pragma once
+#include "config.h"
+
+//----------------------------------------------------------------------
+
+/// Timestamped log of key events, for reproducing game sessions
+class KeyLog {
+public:
+    struct Entry {
+	uint32_t	ms;	///< Time since the start of the session
+	uint32_t	key;
+    };
+    using entryvec_t	= vector<Entry>;
+    using rcentryvec_t	= const entryvec_t&;
+public:
+			KeyLog (void);
+    inline rcentryvec_t	Entries (void) const			{ return _entries; }
+    inline uint32_t	Level (void) const			{ return _level; }
+    inline uint32_t	Moves (void) const			{ return _moves; }
+    inline void		Record (uint32_t ms, uint32_t key)	{ _entries.push_back ({ ms, key }); }
+    inline void		SetResult (uint32_t level, uint32_t moves)	{ _level = level; _moves = moves; }
+    void		Read (const char* filename);
+    void		Write (const char* filename) const;
+private:
+    /// File header, followed by the entries
+    struct Header {
+	char		magic [4];
+	uint16_t	version;
+	uint16_t	level;		///< Level at the end of the session
+	uint32_t	moves;		///< Move count at the end of the session
+	uint32_t	nEntries;
+    };
+    static constexpr const char c_Magic[4] = { 'G','J','K','L' };
+    enum { c_Version = 1 };
+private:
+    entryvec_t		_entries;
+    uint32_t		_level;
+    uint32_t		_moves;
+};
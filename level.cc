@@ -6,10 +6,13 @@
 //----------------------------------------------------------------------
 
 Level::Level (void)
-:_map (MAP_WIDTH * MAP_HEIGHT)
+:_map()
+,_crateAt()
 ,_objects()
+,_robot()
+,_nObjects (0)
 {
-    fill (_map.begin(), _map.end(), tilemap_t::value_type(FloorPix));
+    fill_n (_map, MAP_SIZE, uint8_t(FloorPix));
     MoveRobot (0, 0, RobotNorthPix);
 }
 
@@ -27,21 +30,41 @@ bool Level::CanMoveTo (uint8_t x, uint8_t y, RobotDir where) const noexcept
     return false;
 }
 
-int Level::FindCrate (uint8_t x, uint8_t y) const noexcept
+void Level::AddCrate (uint8_t x, uint8_t y, PicIndex pic) noexcept
 {
-    for (auto i = 0u; i < _objects.size(); ++i)
-	if (_objects[i].x == x && _objects[i].y == y)
-	    return i;
-    return -1;
+    if (_nObjects >= MAX_CRATES)
+	return;
+    _objects[_nObjects] = Object (x, y, pic);
+    _crateAt[y*MAP_WIDTH+x] = ++_nObjects;
 }
 
-bool Level::MoveRobot (RobotDir where)
+void Level::MoveCrate (unsigned index, uint8_t x, uint8_t y) noexcept
 {
-    static const struct {
-	int8_t dx,dy;
-	uint16_t img;
-    } robotdir[] = {{0,-1,RobotNorthPix},{0,1,RobotSouthPix},{1,0,RobotEastPix},{-1,0,RobotWestPix}};
+    auto& o = _objects[index];
+    _crateAt[o.y*MAP_WIDTH+o.x] = 0;
+    o.x = x; o.y = y;
+    _crateAt[y*MAP_WIDTH+x] = index+1;
+}
+
+// Crate order does not matter, so the last one is moved into the hole
+void Level::DisposeCrate (unsigned index) noexcept
+{
+    auto& o = _objects[index];
+    _crateAt[o.y*MAP_WIDTH+o.x] = 0;
+    if (index != --_nObjects) {
+	o = _objects[_nObjects];
+	_crateAt[o.y*MAP_WIDTH+o.x] = index+1;
+    }
+}
+
+static const struct {
+    int8_t dx,dy;
+    uint16_t img;
+} robotdir[] = {{0,-1,RobotNorthPix},{0,1,RobotSouthPix},{1,0,RobotEastPix},{-1,0,RobotWestPix}};
 
+bool Level::MoveRobot (RobotDir where, MoveDelta* pd)
+{
+    MoveDelta d = { uint8_t(where), uint8_t(_robot.pic - RobotNorthPix), false, false, 0 };
     _robot.pic = robotdir[where].img;
     auto newx = _robot.x + robotdir[where].dx;
     auto newcratex = newx + robotdir[where].dx;
@@ -59,29 +82,226 @@ bool Level::MoveRobot (RobotDir where)
 	//	also checks if the square behind crate can be moved into
 	if (FindCrate(newcratex, newcratey) >= 0 || !CanMoveTo(newcratex, newcratey, where))
 	    return false;
-	_objects[ciw].x = newcratex;
-	_objects[ciw].y = newcratey;
-	if (At(newcratex, newcratey) == DisposePix)
+	MoveCrate (ciw, newcratex, newcratey);
+	d.pushed = true;
+	if (At(newcratex, newcratey) == DisposePix) {
+	    d.disposed = true;
+	    d.crate = _objects[ciw].pic - Barrel1Pix;
 	    DisposeCrate (ciw);
+	}
     }
     _robot.x = newx;
     _robot.y = newy;
+    if (pd)
+	*pd = d;
     return true;
 }
 
+// Reverses a move recorded by MoveRobot. Moves must be undone last to first.
+void Level::UndoMove (MoveDelta d) noexcept
+{
+    auto& rd = robotdir[d.dir];
+    uint8_t cratex = _robot.x + rd.dx, cratey = _robot.y + rd.dy;
+    if (d.disposed)
+	AddCrate (cratex, cratey, PicIndex(Barrel1Pix + d.crate));
+    if (d.pushed)
+	MoveCrate (FindCrate (cratex, cratey), _robot.x, _robot.y);
+    MoveRobot (_robot.x - rd.dx, _robot.y - rd.dy, PicIndex(RobotNorthPix + d.face));
+}
+
+//----------------------------------------------------------------------
+// Path finding
+
+// Breadth-first walk distances from the robot to every cell, with crates as obstacles
+void Level::WalkDistances (distmap_t& d) const noexcept
+{
+    fill_n (d, MAP_SIZE, uint8_t(c_Unreachable));
+    uint8_t q [MAP_SIZE];
+    unsigned qhead = 0, qtail = 0;
+    d[q[qtail++] = _robot.y*MAP_WIDTH+_robot.x] = 0;
+    while (qhead < qtail) {
+	auto c = q[qhead++];
+	for (auto dir = 0u; dir < size(robotdir); ++dir) {
+	    uint8_t nx = c%MAP_WIDTH + robotdir[dir].dx, ny = c/MAP_WIDTH + robotdir[dir].dy;
+	    if (!CanMoveTo (nx, ny, RobotDir(dir)) || FindCrate (nx, ny) >= 0 || d[ny*MAP_WIDTH+nx] != c_Unreachable)
+		continue;
+	    d[q[qtail++] = ny*MAP_WIDTH+nx] = d[c]+1;
+	}
+    }
+}
+
+// Backtracks through d from x,y to the robot. path is empty if x,y is unreachable.
+void Level::WalkPath (const distmap_t& d, uint8_t x, uint8_t y, pathvec_t& path) const
+{
+    path.clear();
+    if (x >= MAP_WIDTH || y >= MAP_HEIGHT || d[y*MAP_WIDTH+x] == c_Unreachable)
+	return;
+    path.resize (d[y*MAP_WIDTH+x]);
+    for (auto i = path.size(); i--;) {
+	for (auto dir = 0u; dir < size(robotdir); ++dir) {
+	    uint8_t px = x - robotdir[dir].dx, py = y - robotdir[dir].dy;
+	    if (px < MAP_WIDTH && py < MAP_HEIGHT && d[py*MAP_WIDTH+px] == i && CanMoveTo (x, y, RobotDir(dir))) {
+		path[i] = RobotDir(dir);
+		x = px; y = py;
+		break;
+	    }
+	}
+    }
+}
+
+// Shortest sequence of moves that pushes the crate at x,y into a
+// recycling bin. The search is over crate and robot positions, with
+// all other crates fixed. path is empty if there is no solution.
+void Level::PushPath (uint8_t x, uint8_t y, pathvec_t& path, PushBuffers& b) const
+{
+    static_assert (MAP_SIZE*MAP_SIZE < UINT16_MAX, "push search state must fit in uint16_t");
+    path.clear();
+    unsigned crate0 = y*MAP_WIDTH+x;
+    if (x >= MAP_WIDTH || y >= MAP_HEIGHT || FindCrate (x, y) < 0)
+	return;
+    auto& prev = b.prev;
+    auto& q = b.queue;
+    auto& prevdir = b.prevdir;
+    prev.assign (MAP_SIZE*MAP_SIZE, UINT16_MAX);
+    prevdir.resize (MAP_SIZE*MAP_SIZE);
+    q.clear();
+    uint16_t s0 = crate0*MAP_SIZE + _robot.y*MAP_WIDTH+_robot.x;
+    prev[s0] = s0;
+    q.push_back (s0);
+    for (auto qhead = 0u; qhead < q.size(); ++qhead) {
+	auto s = q[qhead];
+	unsigned crate = s/MAP_SIZE, robot = s%MAP_SIZE;
+	if (At (crate%MAP_WIDTH, crate/MAP_WIDTH) == DisposePix) {
+	    auto len = 0u;
+	    for (auto i = s; i != s0; i = prev[i])
+		++len;
+	    path.resize (len);
+	    for (; s != s0; s = prev[s])
+		path[--len] = RobotDir (prevdir[s]);
+	    return;
+	}
+	for (auto dir = 0u; dir < size(robotdir); ++dir) {
+	    uint8_t nx = robot%MAP_WIDTH + robotdir[dir].dx, ny = robot/MAP_WIDTH + robotdir[dir].dy;
+	    if (!CanMoveTo (nx, ny, RobotDir(dir)))
+		continue;
+	    unsigned nrobot = ny*MAP_WIDTH+nx, ncrate = crate;
+	    if (nrobot == crate) {
+		uint8_t cx = nx + robotdir[dir].dx, cy = ny + robotdir[dir].dy;
+		ncrate = cy*MAP_WIDTH+cx;
+		if (!CanMoveTo (cx, cy, RobotDir(dir)) || (FindCrate (cx, cy) >= 0 && ncrate != crate0))
+		    continue;
+	    } else if (FindCrate (nx, ny) >= 0 && nrobot != crate0)
+		continue;
+	    uint16_t ns = ncrate*MAP_SIZE + nrobot;
+	    if (prev[ns] != UINT16_MAX)
+		continue;
+	    prev[ns] = s;
+	    prevdir[ns] = dir;
+	    q.push_back (ns);
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+
+// Checks consistency of the crates, the occupancy grid, and the robot.
+// Returns the broken invariant, or nullptr if there is none.
+const char* Level::Verify (void) const noexcept
+{
+    if (_nObjects > MAX_CRATES)
+	return "too many crates";
+    for (auto pic : _map)
+	if (pic >= RobotNorthPix)
+	    return "map cell is not a tile";
+    auto ngrid = 0u;
+    for (auto c : _crateAt)
+	ngrid += !!c;
+    if (ngrid != _nObjects)
+	return "two crates on one cell";
+    for (auto i = 0u; i < _nObjects; ++i) {
+	auto& o = _objects[i];
+	if (o.x >= MAP_WIDTH || o.y >= MAP_HEIGHT || _crateAt[o.y*MAP_WIDTH+o.x] != i+1)
+	    return "crate missing from the grid";
+	if (o.pic != Barrel1Pix && o.pic != Barrel2Pix)
+	    return "crate is not a barrel";
+	auto pic = At (o.x, o.y);
+	if (pic == DisposePix)
+	    return "crate not removed in a recycling bin";
+	if (pic != FloorPix && pic != ExitPix && (pic < OWDNorthPix || pic > OWDWestPix))
+	    return "crate inside a wall";
+    }
+    if (_robot.x >= MAP_WIDTH || _robot.y >= MAP_HEIGHT)
+	return "robot outside the map";
+    auto rpic = At (_robot.x, _robot.y);
+    if (rpic != FloorPix && rpic != ExitPix && rpic != DisposePix && (rpic < OWDNorthPix || rpic > OWDWestPix))
+	return "robot inside a wall";
+    if (FindCrate (_robot.x, _robot.y) >= 0)
+	return "robot on a crate";
+    if (_robot.pic < RobotNorthPix || _robot.pic > RobotWestPix)
+	return "robot is not a robot";
+    return nullptr;
+}
+
+//----------------------------------------------------------------------
+
+const char c_RobotDirChars [5] = "NSEW";
+
+// Level text format, also used by Write. The robot is always '@'.
+static const char picToChar[NumberOfMapPics+1] = "0E.^v><#%+~!`   @NP";
+
+// The spaces in picToChar are unused robot pics, not level chars
+bool Level::IsLevelChar (char c) noexcept
+{
+    return c && c != ' ' && strchr (picToChar, c);
+}
+
+/// Checks that ldata is the text of exactly one level, returning the problem or nullptr.
+/// Text that passes can be given to Load, but the result still needs Verify.
+const char* Level::CheckText (const char* ldata) noexcept
+{
+    if (strnlen (ldata, MAP_SIZE+1) != MAP_SIZE)
+	return "level is not MAP_SIZE chars";
+    auto nRobots = 0u, nCrates = 0u;
+    for (auto i = 0u; i < MAP_SIZE; ++i) {
+	if (!IsLevelChar (ldata[i]))
+	    return "invalid char in level";
+	auto pic = distance (picToChar, strchr (picToChar, ldata[i]));
+	nRobots += pic >= RobotNorthPix && pic <= RobotWestPix;
+	nCrates += pic >= Barrel1Pix;
+    }
+    if (nRobots != 1)
+	return "level must have one robot";
+    if (nCrates > MAX_CRATES)
+	return "level has too many crates";
+    return nullptr;
+}
+
+/// Loads all the levels in ldata, which is in the levels.txt format
+vector<Level> Level::LoadAll (const char* ldata)
+{
+    vector<Level> levels;
+    while (ldata) {
+	levels.emplace_back();
+	ldata = levels.back().Load (ldata);
+    }
+    return levels;
+}
+
 const char* Level::Load (const char* ldata)
 {
-    static const char picToChar[NumberOfMapPics+1] = "0E.^v><#%+~!`   @NP";
-    _objects.clear();
+    _nObjects = 0;
+    fill_n (_crateAt, MAP_SIZE, 0);
     for (auto y = 0u; y < MAP_HEIGHT; ++y) {
 	for (auto x = 0u; x < MAP_WIDTH; ++x) {
 	    auto c = *ldata++;
 	    auto pf = strchr (picToChar, c);
 	    auto pic = pf ? PicIndex(distance(picToChar,pf)) : FloorPix;
 	    if (pic >= RobotNorthPix) {
-		if (pic >= Barrel1Pix)
+		if (pic >= Barrel1Pix) {
+		    if (_nObjects >= MAX_CRATES)
+			throw runtime_error ("level has too many crates");
 		    AddCrate (x, y, pic);
-		else
+		} else
 		    MoveRobot (x, y, pic);
 	    	pic = FloorPix;
 	    }
@@ -90,3 +310,37 @@ const char* Level::Load (const char* ldata)
     }
     return *ldata ? ldata : nullptr;
 }
+
+// Writes MAP_SIZE chars in the format read by Load
+void Level::Write (char* ldata) const noexcept
+{
+    for (auto i = 0u; i < MAP_SIZE; ++i)
+	ldata[i] = picToChar[_map[i]];
+    for (auto i = 0u; i < _nObjects; ++i)
+	ldata[_objects[i].y*MAP_WIDTH+_objects[i].x] = picToChar[_objects[i].pic];
+    ldata[_robot.y*MAP_WIDTH+_robot.x] = picToChar[RobotWestPix];
+}
+
+void Level::Pack (Packed& p) const noexcept
+{
+    memset (&p, 0, sizeof(p));
+    p.robot = _robot.y*MAP_WIDTH+_robot.x;
+    for (auto i = 0u; i < _nObjects; ++i) {
+	auto c = _objects[i].y*MAP_WIDTH+_objects[i].x;
+	p.crates[c/8] |= 1<<(c%8);
+    }
+}
+
+// Replaces robot and crates with p, keeping the map. Crate pics are not packed.
+void Level::Unpack (const Packed& p) noexcept
+{
+    _nObjects = 0;
+    fill_n (_crateAt, MAP_SIZE, 0);
+    for (auto b = 0u; b < size(p.crates); ++b) {
+	for (unsigned bits = p.crates[b]; bits; bits &= bits-1) {
+	    auto c = b*8 + __builtin_ctz (bits);
+	    AddCrate (c%MAP_WIDTH, c/MAP_WIDTH, Barrel1Pix);
+	}
+    }
+    MoveRobot (p.robot%MAP_WIDTH, p.robot/MAP_WIDTH, RobotNorthPix);
+}
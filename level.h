@@ -10,7 +10,9 @@ enum {
     TILE_W	= 16,
     TILE_H	= 16,
     MAP_WIDTH	= 20,
-    MAP_HEIGHT	= 12
+    MAP_HEIGHT	= 12,
+    MAP_SIZE	= MAP_WIDTH*MAP_HEIGHT,
+    MAX_CRATES	= 64
 };
 
 //----------------------------------------------------------------------
@@ -50,8 +52,16 @@ enum RobotDir {
     West
 };
 
+/// Move string letters, indexed by RobotDir
+extern const char c_RobotDirChars [5];
+
 //----------------------------------------------------------------------
 
+/// Level map, crates, and the robot.
+///
+/// All storage is inline, so a Level is trivially copyable and copying
+/// it is a plain memcpy with no heap allocation. Crate positions are
+/// mirrored in an occupancy grid for constant time lookup.
 class Level {
 public:
     struct Object {
@@ -60,28 +70,76 @@ public:
 	uint16_t	pic;
 	inline		Object (uint8_t nx = 0, uint8_t ny = 0, PicIndex npic = FloorPix) : x (nx), y (ny), pic (npic) {}
     };
-    using tilemap_t	= vector<uint8_t>;
-    using objvec_t	= vector<Object>;
+    /// One byte undo record for a successful MoveRobot
+    struct MoveDelta {
+	uint8_t		dir:2;		///< RobotDir of the move
+	uint8_t		face:2;		///< RobotDir the robot faced before the move
+	uint8_t		pushed:1;	///< A crate was pushed
+	uint8_t		disposed:1;	///< The pushed crate went into a recycling bin
+	uint8_t		crate:1;	///< Barrel pic of the disposed crate, relative to Barrel1Pix
+    };
+    struct objrange_t {
+	const Object*	b;
+	const Object*	e;
+	inline const Object*	begin (void) const	{ return b; }
+	inline const Object*	end (void) const	{ return e; }
+	inline unsigned		size (void) const	{ return e - b; }
+	inline bool		empty (void) const	{ return b == e; }
+    };
+    /// Robot and crate positions, for storing many states of one level
+    struct Packed {
+	uint8_t		robot;				///< Cell index
+	uint8_t		crates [(MAP_SIZE+7)/8];	///< Bit per cell
+	inline bool	operator< (const Packed& v) const	{ return memcmp (this, &v, sizeof(*this)) < 0; }
+	inline bool	operator== (const Packed& v) const	{ return !memcmp (this, &v, sizeof(*this)); }
+	inline bool	operator!= (const Packed& v) const	{ return !operator== (v); }
+    };
+    /// PushPath search state, kept by the caller to reuse the allocations
+    struct PushBuffers {
+	vector<uint16_t>	prev;		///< Previous search state of each, UINT16_MAX if unvisited
+	vector<uint16_t>	queue;
+	vector<uint8_t>		prevdir;	///< Move from the previous state
+    };
+    using tilemap_t	= uint8_t [MAP_SIZE];
     using rctilemap_t	= const tilemap_t&;
-    using rcobjvec_t	= const objvec_t&;
+    using distmap_t	= uint8_t [MAP_SIZE];	///< Moves needed to reach each cell
+    using pathvec_t	= vector<RobotDir>;
+    enum { c_Unreachable = UINT8_MAX };
 public:
 			Level (void);
     inline PicIndex	At (uint8_t x, uint8_t y) const		{ return PicIndex (_map[y*MAP_WIDTH+x]); }
     inline rctilemap_t	Map (void) const			{ return _map; }
-    inline rcobjvec_t	Objects (void) const			{ return _objects; }
+    inline objrange_t	Objects (void) const			{ return { _objects, _objects + _nObjects }; }
     const Object&	Robot (void) const			{ return _robot; }
     inline void		SetCell (uint8_t x, uint8_t y, PicIndex pic)	{ _map[y*MAP_WIDTH+x] = pic; }
-    bool		Finished (void) const			{ return _objects.empty() && At(_robot.x, _robot.y) == ExitPix; }
-    bool		MoveRobot (RobotDir where);
+    bool		Finished (void) const			{ return !_nObjects && At(_robot.x, _robot.y) == ExitPix; }
+    bool		MoveRobot (RobotDir where, MoveDelta* pd = nullptr);
+    void		UndoMove (MoveDelta d) noexcept;
+    inline bool		IsCrateAt (uint8_t x, uint8_t y) const noexcept	{ return FindCrate (x, y) >= 0; }
+    bool		CanMoveTo (uint8_t x, uint8_t y, RobotDir where) const noexcept;
+    void		WalkDistances (distmap_t& d) const noexcept;
+    void		WalkPath (const distmap_t& d, uint8_t x, uint8_t y, pathvec_t& path) const;
+    void		PushPath (uint8_t x, uint8_t y, pathvec_t& path, PushBuffers& b) const;
     const char*		Load (const char* ldata);
+    void		Write (char* ldata) const noexcept;
+    const char*		Verify (void) const noexcept;
+    static bool		IsLevelChar (char c) noexcept;
+    static const char*	CheckText (const char* ldata) noexcept;
+    static vector<Level> LoadAll (const char* ldata);
+    void		Pack (Packed& p) const noexcept;
+    void		Unpack (const Packed& p) noexcept;
 private:
-    bool		CanMoveTo (uint8_t x, uint8_t y, RobotDir where) const noexcept;
     inline void		MoveRobot (uint8_t x, uint8_t y, PicIndex pic)	{ _robot.x = x; _robot.y = y; _robot.pic = pic; }
-    int			FindCrate (uint8_t x, uint8_t y) const noexcept;
-    inline void		AddCrate (uint8_t x, uint8_t y, PicIndex pic)	{ _objects.emplace_back (x, y, pic); }
-    inline void		DisposeCrate (unsigned index)			{ _objects.erase (_objects.begin() + index); }
+    inline int		FindCrate (uint8_t x, uint8_t y) const noexcept	{ return x < MAP_WIDTH && y < MAP_HEIGHT ? _crateAt[y*MAP_WIDTH+x]-1 : -1; }
+    void		AddCrate (uint8_t x, uint8_t y, PicIndex pic) noexcept;
+    void		MoveCrate (unsigned index, uint8_t x, uint8_t y) noexcept;
+    void		DisposeCrate (unsigned index) noexcept;
 private:
     tilemap_t		_map;
-    objvec_t		_objects;
+    uint8_t		_crateAt [MAP_SIZE];	///< Index+1 of the crate on each cell, 0 if none
+    Object		_objects [MAX_CRATES];
     Object		_robot;
+    uint8_t		_nObjects;
 };
+
+static_assert (is_trivially_copyable<Level>::value, "Level must be copyable with memcpy");
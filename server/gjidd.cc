@@ -0,0 +1,305 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+//
+// Headless game server for automated play. Clients connect to a Unix
+// socket and send one command per line; each gets a one line reply,
+// starting with "ok" or "error".
+//
+//	level <n>		new session on built-in level n -> ok <id>
+//	load <map>		new session from MAP_SIZE chars of level text -> ok <id>
+//	move <id> <dirs>	move the robot, dirs is a string of NSEW -> ok <moved> <crates> <finished>
+//	state <id>		-> ok <moves> <crates> <finished> <map>
+//	close <id>		end the session -> ok
+//
+// Commands are answered in order, including those sent just before the
+// client closes its end. A client is dropped if it sends a line longer
+// than any valid command or lets c_MaxOutput bytes of replies pile up.
+//
+// Sessions belong to the connection that created them. Connections are
+// dealt out to a fixed pool of worker threads, each with its own epoll
+// set, so a session is only ever touched by one thread and no locks are
+// needed.
+
+#include "../level.h"
+#include "../data/levels.txt"
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <signal.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+//----------------------------------------------------------------------
+
+/// Built-in levels, read-only after startup
+static vector<Level> s_Levels;
+
+enum {
+    c_MaxLine	= MAP_SIZE+64,	///< Longer than any valid command
+    c_MaxOutput	= 1<<20		///< Unsent replies allowed before the client is dropped
+};
+
+//----------------------------------------------------------------------
+
+class Connection {
+public:
+    struct Session {
+	Level		level;
+	uint32_t	moves;
+	bool		open;
+    };
+public:
+    inline explicit	Connection (int fd) : _fd (fd), _eof (false), _in(), _out(), _sessions(), _freeSessions() {}
+    inline		~Connection (void) noexcept	{ close (_fd); }
+    inline int		Fd (void) const			{ return _fd; }
+    inline uint32_t	Events (void) const		{ return (_eof ? 0u : uint32_t(EPOLLIN)) | (_out.empty() ? 0u : uint32_t(EPOLLOUT)); }
+    inline bool		Done (void) const		{ return _eof && _out.empty(); }
+    bool		Read (void);
+    bool		Flush (void);
+private:
+    void		Execute (char* line);
+    Session*		FindSession (const char* id);
+    void		NewSession (const Level& l);
+    void		Reply (const char* fmt, ...) __attribute__((format(printf,2,3)));
+private:
+    int			_fd;
+    bool		_eof;		///< The client will send no more commands
+    string		_in;
+    string		_out;
+    vector<Session>	_sessions;
+    vector<uint32_t>	_freeSessions;	///< Indexes of closed _sessions, for reuse
+};
+
+/// Reads and executes all complete lines. Returns false when the client must be dropped.
+bool Connection::Read (void)
+{
+    char buf [4096];
+    while (!_eof) {
+	auto n = read (_fd, buf, sizeof(buf));
+	if (n > 0)
+	    _in.append (buf, n);
+	else if (!n)
+	    _eof = true;	// lines received before the end are still answered
+	else if (errno == EINTR)
+	    continue;
+	else
+	    return errno == EAGAIN;
+	size_t start = 0;
+	for (size_t eol; string::npos != (eol = _in.find ('\n', start)); start = eol+1) {
+	    _in[eol] = 0;
+	    Execute (&_in[start]);
+	}
+	_in.erase (0, start);
+	if (_in.size() > c_MaxLine || !Flush() || _out.size() > c_MaxOutput)
+	    return false;
+    }
+    return true;
+}
+
+/// Writes queued replies. Returns false on error.
+bool Connection::Flush (void)
+{
+    while (!_out.empty()) {
+	auto n = send (_fd, _out.data(), _out.size(), MSG_NOSIGNAL);
+	if (n < 0)
+	    return errno == EAGAIN || errno == EINTR;
+	_out.erase (0, n);
+    }
+    return true;
+}
+
+void Connection::Reply (const char* fmt, ...)
+{
+    char buf [MAP_SIZE+64];
+    va_list args;
+    va_start (args, fmt);
+    auto n = vsnprintf (buf, sizeof(buf), fmt, args);
+    va_end (args);
+    _out.append (buf, min<size_t> (n, sizeof(buf)-1));
+    _out += '\n';
+}
+
+Connection::Session* Connection::FindSession (const char* id)
+{
+    char* idend;
+    auto i = strtoul (id, &idend, 10);
+    if (idend == id || i >= _sessions.size() || !_sessions[i].open)
+	return nullptr;
+    return &_sessions[i];
+}
+
+void Connection::NewSession (const Level& l)
+{
+    uint32_t id = _sessions.size();
+    if (!_freeSessions.empty()) {
+	id = _freeSessions.back();
+	_freeSessions.pop_back();
+    } else
+	_sessions.emplace_back();
+    _sessions[id] = { l, 0, true };
+    Reply ("ok %u", id);
+}
+
+void Connection::Execute (char* line)
+{
+    char* tokpos;
+    auto cmd = strtok_r (line, " \t\r", &tokpos);
+    auto arg1 = strtok_r (nullptr, " \t\r", &tokpos);
+    auto arg2 = strtok_r (nullptr, " \t\r", &tokpos);
+    if (!cmd)
+	return Reply ("error empty command");
+    if (!strcmp (cmd, "level")) {
+	auto n = arg1 ? strtoul (arg1, nullptr, 10) : 0;
+	if (n < 1 || n > s_Levels.size())
+	    return Reply ("error no such level");
+	return NewSession (s_Levels[n-1]);
+    } else if (!strcmp (cmd, "load")) {
+	if (!arg1 || Level::CheckText (arg1))
+	    return Reply ("error invalid level");
+	Level l;
+	l.Load (arg1);
+	if (l.Verify())
+	    return Reply ("error invalid level");
+	return NewSession (l);
+    }
+    auto s = arg1 ? FindSession (arg1) : nullptr;
+    if (!s)
+	return Reply ("error no such session");
+    if (!strcmp (cmd, "move")) {
+	auto moved = 0u;
+	for (auto d = arg2; d && *d; ++d) {
+	    auto dir = strchr (c_RobotDirChars, *d);
+	    if (!dir || !*dir)
+		return Reply ("error invalid direction");
+	    moved += s->level.MoveRobot (RobotDir (dir - c_RobotDirChars));
+	}
+	s->moves += moved;
+	Reply ("ok %u %u %u", moved, s->level.Objects().size(), s->level.Finished());
+    } else if (!strcmp (cmd, "state")) {
+	char map [MAP_SIZE+1];
+	s->level.Write (map);
+	map[MAP_SIZE] = 0;
+	Reply ("ok %u %u %u %s", s->moves, s->level.Objects().size(), s->level.Finished(), map);
+    } else if (!strcmp (cmd, "close")) {
+	s->open = false;
+	_freeSessions.push_back (s - _sessions.data());
+	Reply ("ok");
+    } else
+	Reply ("error unknown command");
+}
+
+//----------------------------------------------------------------------
+
+/// Serves the connections added to its epoll set
+class Worker {
+public:
+			Worker (void);
+    inline		~Worker (void) noexcept		{ close (_epfd); }
+			Worker (const Worker&) = delete;
+    void		operator= (const Worker&) = delete;
+    void		Add (int fd);
+    void		Run (void);
+private:
+    void		Watch (Connection* c, int op);
+private:
+    int			_epfd;
+};
+
+Worker::Worker (void)
+:_epfd (epoll_create1 (EPOLL_CLOEXEC))
+{
+    if (_epfd < 0)
+	throw runtime_error ("epoll_create failed");
+}
+
+// Called from the accepting thread; the connection is used only by Run after this
+void Worker::Add (int fd)
+{
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    Watch (new Connection (fd), EPOLL_CTL_ADD);
+}
+
+void Worker::Watch (Connection* c, int op)
+{
+    epoll_event ev;
+    ev.events = c->Events();
+    ev.data.ptr = c;
+    epoll_ctl (_epfd, op, c->Fd(), &ev);
+}
+
+void Worker::Run (void)
+{
+    epoll_event events [64];
+    for (;;) {
+	auto n = epoll_wait (_epfd, events, size(events), -1);
+	for (auto i = 0; i < n; ++i) {
+	    auto c = static_cast<Connection*>(events[i].data.ptr);
+	    auto oldEvents = c->Events();
+	    // Hangups and errors also go to Read, which finds the end of file or the error
+	    auto ok = (!(events[i].events & (EPOLLIN| EPOLLERR| EPOLLHUP)) || c->Read()) && c->Flush();
+	    if (!ok || c->Done()) {
+		epoll_ctl (_epfd, EPOLL_CTL_DEL, c->Fd(), nullptr);
+		delete c;
+	    } else if (oldEvents != c->Events())
+		Watch (c, EPOLL_CTL_MOD);
+	}
+    }
+}
+
+//----------------------------------------------------------------------
+
+int main (int argc, char* const* argv)
+{
+    auto nthreads = max (1u, thread::hardware_concurrency());
+    auto badargs = false;
+    for (int opt; 0 < (opt = getopt (argc, argv, "j:"));) {
+	if (opt == 'j')				// -j n: number of worker threads
+	    nthreads = max (1, atoi (optarg));
+	else
+	    badargs = true;
+    }
+    if (badargs || optind != argc-1) {
+	printf ("Usage: %s [-j threads] socket\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+    try {
+	s_Levels = Level::LoadAll (levels_data);
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (strlen (argv[optind]) >= sizeof(addr.sun_path))
+	    throw runtime_error ("socket path is too long");
+	strcpy (addr.sun_path, argv[optind]);
+	// Replace a stale socket from a previous run, but nothing else
+	struct stat st;
+	if (!lstat (addr.sun_path, &st)) {
+	    if (!S_ISSOCK (st.st_mode))
+		throw runtime_error ("socket path exists and is not a socket");
+	    unlink (addr.sun_path);
+	}
+	auto lfd = socket (AF_UNIX, SOCK_STREAM| SOCK_CLOEXEC, 0);
+	if (lfd < 0 || bind (lfd, (const sockaddr*) &addr, sizeof(addr)) || listen (lfd, SOMAXCONN))
+	    throw runtime_error (strerror (errno));
+	signal (SIGPIPE, SIG_IGN);
+
+	vector<Worker> workers (nthreads);
+	for (auto& w : workers)
+	    thread (&Worker::Run, &w).detach();
+	for (auto next = 0u;; next = (next+1) % workers.size()) {
+	    auto fd = accept4 (lfd, nullptr, nullptr, SOCK_CLOEXEC);
+	    if (fd >= 0)
+		workers[next].Add (fd);
+	    else if (errno != EINTR && errno != ECONNABORTED)
+		throw runtime_error (strerror (errno));
+	}
+    } catch (exception& e) {
+	printf ("Error: %s\n", e.what());
+    }
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,403 @@
+// Copyright (c) 1995 by Mike Sharov <msharov@users.sourceforge.net>
+// This file is free software, distributed under the MIT License.
+//
+// Level solver using breadth-first search with the frontier on disk.
+//
+// Each depth layer is a sorted file of Level::Packed states. A layer is
+// expanded by streaming the previous one from a memory-mapped file into
+// a bounded buffer of successors, which is sorted and written out as a
+// run file whenever it fills. The runs are then merged, dropping
+// duplicates and every state already in the visited file, which is kept
+// as the sorted union of all layers. Because one-way doors make moves
+// irreversible, comparing against only the last two layers is not
+// enough. Memory use is the successor buffer plus one page per merged
+// file, so levels with state spaces far larger than RAM can be solved
+// given enough disk. The files are removed when the search ends, fails,
+// or is interrupted with a signal.
+
+#include "../level.h"
+#include "../data/levels.txt"
+#include <algorithm>
+#include <string>
+#include <queue>
+#include <memory>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using state_t = Level::Packed;
+
+//----------------------------------------------------------------------
+
+static volatile sig_atomic_t s_Interrupted = false;
+
+static void OnSignal (int)
+{
+    s_Interrupted = true;
+}
+
+/// Called in the search loops, so that an interrupted search unwinds and removes its files
+static inline void CheckInterrupted (void)
+{
+    if (s_Interrupted)
+	throw runtime_error ("interrupted");
+}
+
+//----------------------------------------------------------------------
+
+/// Read-only memory mapped file of sorted states
+class StateFile {
+public:
+    explicit		StateFile (const string& name);
+    inline		~StateFile (void) noexcept	{ if (_states) munmap (const_cast<state_t*>(_states), _n*sizeof(state_t)); }
+			StateFile (const StateFile&) = delete;
+    void		operator= (const StateFile&) = delete;
+    inline const state_t* begin (void) const		{ return _states; }
+    inline const state_t* end (void) const		{ return _states + _n; }
+    inline size_t	size (void) const		{ return _n; }
+private:
+    const state_t*	_states;
+    size_t		_n;
+};
+
+StateFile::StateFile (const string& name)
+:_states (nullptr)
+,_n (0)
+{
+    auto fd = open (name.c_str(), O_RDONLY| O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat (fd, &st))
+	throw runtime_error ("unable to open " + name);
+    if ((_n = st.st_size / sizeof(state_t))) {
+	auto p = mmap (nullptr, _n*sizeof(state_t), PROT_READ, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+	    close (fd);
+	    throw runtime_error ("unable to map " + name);
+	}
+	madvise (p, _n*sizeof(state_t), MADV_SEQUENTIAL);
+	_states = static_cast<const state_t*>(p);
+    }
+    close (fd);
+}
+
+/// Buffered sequential writer of states
+class StateWriter {
+public:
+    explicit		StateWriter (const string& name);
+    inline		~StateWriter (void) noexcept	{ if (_f) fclose (_f); }
+			StateWriter (const StateWriter&) = delete;
+    void		operator= (const StateWriter&) = delete;
+    inline void		Write (const state_t& s)	{ fwrite (&s, sizeof(s), 1, _f); ++_n; }
+    inline size_t	size (void) const		{ return _n; }
+    void		Close (void);
+private:
+    FILE*		_f;
+    size_t		_n;
+    string		_name;
+};
+
+StateWriter::StateWriter (const string& name)
+:_f (fopen (name.c_str(), "wb"))
+,_n (0)
+,_name (name)
+{
+    if (!_f)
+	throw runtime_error ("unable to create " + name);
+}
+
+void StateWriter::Close (void)
+{
+    auto ok = !ferror (_f);
+    ok &= !fclose (_f);
+    _f = nullptr;
+    if (!ok)
+	throw runtime_error ("unable to write " + _name);
+}
+
+//----------------------------------------------------------------------
+
+class Solver {
+public:
+			Solver (const Level& l, const char* tmpdir, size_t memory);
+			~Solver (void) noexcept;
+			Solver (const Solver&) = delete;
+    void		operator= (const Solver&) = delete;
+    bool		Solve (string& moves);
+private:
+    inline string	FileName (char type, unsigned n) const	{ return _dir + '/' + _base + type + to_string (n); }
+    inline string	LayerName (unsigned depth) const	{ return FileName ('L', depth); }
+    inline string	RunName (unsigned run) const		{ return FileName ('R', run); }
+    inline string	VisitedName (unsigned gen) const	{ return FileName ('V', gen % 2); }
+    inline void		Expand (const state_t& s, state_t succ[4], bool moved[4], bool finished[4]);
+    void		WriteRun (unsigned run);
+    static size_t	Merge (const vector<const StateFile*>& ins, const StateFile* exclude, StateWriter& out);
+    void		Reconstruct (unsigned depth, state_t s, string& moves);
+private:
+    Level		_level;
+    Level		_work;
+    string		_dir;
+    string		_base;		///< Name prefix of all search files
+    vector<state_t>	_buf;		///< Successors of the layer being expanded
+    size_t		_bufCapacity;
+};
+
+Solver::Solver (const Level& l, const char* tmpdir, size_t memory)
+:_level (l)
+,_work (l)
+,_dir (tmpdir)
+,_base ("gjids." + to_string (getpid()) + '.')
+,_buf()
+,_bufCapacity (max<size_t> (memory / sizeof(state_t), 1024))
+{
+    _buf.reserve (_bufCapacity);
+}
+
+/// Removes all search files, also after an error or interruption
+Solver::~Solver (void) noexcept
+{
+    auto d = opendir (_dir.c_str());
+    if (!d)
+	return;
+    // Collected first, since unlinking while reading the directory can skip entries
+    vector<string> names;
+    while (auto e = readdir (d))
+	if (!strncmp (e->d_name, _base.c_str(), _base.size()))
+	    names.emplace_back (e->d_name);
+    for (const auto& n : names)
+	unlinkat (dirfd (d), n.c_str(), 0);
+    closedir (d);
+}
+
+/// Computes the successors of s in each direction
+void Solver::Expand (const state_t& s, state_t succ[4], bool moved[4], bool finished[4])
+{
+    for (auto dir = 0u; dir < 4; ++dir) {
+	_work.Unpack (s);
+	moved[dir] = _work.MoveRobot (RobotDir (dir));
+	finished[dir] = moved[dir] && _work.Finished();
+	if (moved[dir])
+	    _work.Pack (succ[dir]);
+    }
+}
+
+void Solver::WriteRun (unsigned run)
+{
+    sort (_buf.begin(), _buf.end());
+    StateWriter w (RunName (run));
+    for (auto i = 0u; i < _buf.size(); ++i)
+	if (!i || _buf[i] != _buf[i-1])
+	    w.Write (_buf[i]);
+    w.Close();
+    _buf.clear();
+}
+
+/// Merges sorted inputs into out, skipping duplicates and states in exclude
+size_t Solver::Merge (const vector<const StateFile*>& ins, const StateFile* exclude, StateWriter& out)
+{
+    using head_t = pair<const state_t*, const state_t*>;	// next and end of each input
+    auto cmp = [](const head_t& a, const head_t& b) { return *b.first < *a.first; };
+    priority_queue<head_t, vector<head_t>, decltype(cmp)> heads (cmp);
+    for (auto f : ins)
+	if (f->size())
+	    heads.push ({ f->begin(), f->end() });
+    const state_t* x = exclude ? exclude->begin() : nullptr;
+    const state_t* xend = exclude ? exclude->end() : nullptr;
+    const state_t* last = nullptr;
+    for (size_t n = 0; !heads.empty(); ++n) {
+	if (!(n % 65536))
+	    CheckInterrupted();
+	auto h = heads.top();
+	heads.pop();
+	auto& s = *h.first;
+	if (!last || *last != s) {
+	    while (x < xend && *x < s)
+		++x;
+	    if (x == xend || *x != s)
+		out.Write (s);
+	    last = &s;
+	}
+	if (++h.first < h.second)
+	    heads.push (h);
+    }
+    return out.size();
+}
+
+bool Solver::Solve (string& moves)
+{
+    state_t start, goal;
+    _level.Pack (start);
+    {
+	StateWriter l0 (LayerName (0)), v0 (VisitedName (0));
+	l0.Write (start);
+	v0.Write (start);
+	l0.Close();
+	v0.Close();
+    }
+    auto found = _level.Finished();
+    goal = start;
+    auto depth = 0u;
+    for (size_t layerSize = 1; !found && layerSize; ++depth) {
+	// Expand the layer into sorted runs
+	auto nruns = 0u;
+	{
+	    StateFile layer (LayerName (depth));
+	    for (auto s = layer.begin(); s < layer.end() && !found; ++s) {
+		CheckInterrupted();
+		state_t succ[4];
+		bool moved[4], finished[4];
+		Expand (*s, succ, moved, finished);
+		for (auto dir = 0u; dir < 4 && !found; ++dir) {
+		    if (!moved[dir])
+			continue;
+		    if (finished[dir]) {
+			goal = succ[dir];
+			found = true;
+		    } else {
+			_buf.push_back (succ[dir]);
+			if (_buf.size() >= _bufCapacity)
+			    WriteRun (nruns++);
+		    }
+		}
+	    }
+	}
+	// The rest of the layer is not needed once the goal is reached
+	if (found) {
+	    _buf.clear();
+	    ++depth;
+	    break;
+	}
+	if (!_buf.empty())
+	    WriteRun (nruns++);
+	// Merge the runs into the next layer, without visited states
+	{
+	    vector<unique_ptr<StateFile>> runs;
+	    vector<const StateFile*> ins;
+	    for (auto r = 0u; r < nruns; ++r) {
+		runs.emplace_back (new StateFile (RunName (r)));
+		ins.push_back (runs.back().get());
+	    }
+	    StateFile visited (VisitedName (depth));
+	    StateWriter next (LayerName (depth+1));
+	    layerSize = Merge (ins, &visited, next);
+	    next.Close();
+	    runs.clear();
+	    for (auto r = 0u; r < nruns; ++r)
+		unlink (RunName (r).c_str());
+	    // Add the new layer to the visited states
+	    StateFile nextLayer (LayerName (depth+1));
+	    StateWriter nextVisited (VisitedName (depth+1));
+	    Merge ({ &visited, &nextLayer }, nullptr, nextVisited);
+	    nextVisited.Close();
+	    printf ("depth %u: %zu new states, %zu visited\n", depth+1, layerSize, nextVisited.size());
+	}
+    }
+    if (found)
+	Reconstruct (depth, goal, moves);
+    return found;
+}
+
+/// Walks back through the layers from s at depth to the start
+void Solver::Reconstruct (unsigned depth, state_t s, string& moves)
+{
+    moves.assign (depth, ' ');
+    while (depth--) {
+	StateFile layer (LayerName (depth));
+	auto prevFound = false;
+	for (auto p = layer.begin(); p < layer.end() && !prevFound; ++p) {
+	    CheckInterrupted();
+	    state_t succ[4];
+	    bool moved[4], finished[4];
+	    Expand (*p, succ, moved, finished);
+	    for (auto dir = 0u; dir < 4 && !prevFound; ++dir) {
+		if (moved[dir] && succ[dir] == s) {
+		    moves[depth] = c_RobotDirChars[dir];
+		    s = *p;
+		    prevFound = true;
+		}
+	    }
+	}
+	if (!prevFound)
+	    throw runtime_error ("search layers are inconsistent");
+    }
+}
+
+//----------------------------------------------------------------------
+
+/// Reads a level from a text file, ignoring anything but level chars
+static Level LoadLevelFile (const char* filename)
+{
+    auto f = fopen (filename, "r");
+    if (!f)
+	throw runtime_error ("unable to open level file");
+    char ldata [MAP_SIZE+1];
+    auto n = 0u;
+    for (int c; n < MAP_SIZE && EOF != (c = fgetc (f));)
+	if (Level::IsLevelChar (c))
+	    ldata[n++] = c;
+    fclose (f);
+    if (n < MAP_SIZE)
+	throw runtime_error ("level file is too short");
+    ldata[n] = 0;
+    if (auto err = Level::CheckText (ldata))
+	throw runtime_error (err);
+    Level l;
+    l.Load (ldata);
+    if (auto err = l.Verify())
+	throw runtime_error (err);
+    return l;
+}
+
+int main (int argc, char* const* argv)
+{
+    auto tmpdir = getenv ("TMPDIR") ? getenv ("TMPDIR") : "/tmp";
+    size_t memory = 256;
+    const char* levelFile = nullptr;
+    auto badargs = false;
+    for (int opt; 0 < (opt = getopt (argc, argv, "d:m:f:"));) {
+	if (opt == 'd')				// -d dir: put search files in dir
+	    tmpdir = optarg;
+	else if (opt == 'm') {			// -m MB: successor buffer size
+	    char* end;
+	    auto mb = strtol (optarg, &end, 10);
+	    if (end == optarg || *end || mb < 1 || mb > (1<<20))
+		badargs = true;
+	    memory = mb;
+	}
+	else if (opt == 'f')			// -f file: solve a level from a file
+	    levelFile = optarg;
+	else
+	    badargs = true;
+    }
+    if (badargs || optind != (levelFile ? argc : argc-1)) {	// a level number or -f, not both
+	printf ("Usage: %s [-d tmpdir] [-m MB] {level | -f levelfile}\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+    try {
+	auto levels = Level::LoadAll (levels_data);
+	Level l;
+	if (levelFile)
+	    l = LoadLevelFile (levelFile);
+	else {
+	    auto n = strtoul (argv[optind], nullptr, 10);
+	    if (n < 1 || n > levels.size())
+		throw runtime_error ("no such level");
+	    l = levels[n-1];
+	}
+	string moves;
+	for (auto sig : { SIGINT, SIGTERM, SIGHUP })
+	    signal (sig, OnSignal);
+	Solver solver (l, tmpdir, memory << 20);
+	if (!solver.Solve (moves)) {
+	    printf ("No solution\n");
+	    return EXIT_FAILURE;
+	}
+	printf ("Solved in %zu moves: %s\n", moves.size(), moves.c_str());
+	return EXIT_SUCCESS;
+    } catch (exception& e) {
+	printf ("Error: %s\n", e.what());
+    }
+    return EXIT_FAILURE;
+}
@@ -7,6 +7,9 @@
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <algorithm>
 #include <errno.h>
 #define unsigned const unsigned	// xbm format does not include a const by default
 #include "data/font3x5.xbm"
@@ -30,6 +33,49 @@ static void Terminate (void)
 
 //----------------------------------------------------------------------
 
+// Sizes of fixed length requests on the wire, from the X protocol spec
+enum {
+    c_CompositeReqSize		= 36,
+    c_CompositeGlyphsReqSize	= 28,	// plus glyph elements
+    c_FillRectanglesReqSize	= 20,	// plus 8 per rectangle
+    c_PutImageReqSize		= 24,	// plus data
+    c_CreatePixmapReqSize	= 16,
+    c_CreatePictureReqSize	= 20,	// plus 4 per value
+    c_FreePixmapReqSize		= 8,
+    c_CreateGlyphSetReqSize	= 12,
+    c_AddGlyphsReqSize		= 12,	// plus 16 per glyph, plus data
+    c_CreateWindowReqSize	= 32,	// plus 4 per value
+    c_CreateGCReqSize		= 16,	// plus 4 per value
+    c_ChangePropertyReqSize	= 24,	// plus data padded to 4
+    c_MapWindowReqSize		= 8,
+    c_SetPictureTransformReqSize = 44,
+    c_GetKeyboardMappingReqSize	= 8,
+    c_QueryVersionReqSize	= 12,
+    c_InternAtomReqSize		= 8,	// plus name padded to 4
+    c_QueryPictFormatsReqSize	= 4,
+    c_GetInputFocusReqSize	= 4,
+    c_FreePictureReqSize	= 8,
+    c_FreeGlyphSetReqSize	= 8
+};
+
+static inline uint32_t Pad4 (uint32_t n) { return (n+3)&~3u; }
+
+void CXApp::CountRequest (SXStats::EKind k, uint32_t bytes) noexcept
+{
+    ++_frameStats.requests[k];
+    _frameStats.bytes[k] += bytes;
+    ++_totalStats.requests[k];
+    _totalStats.bytes[k] += bytes;
+}
+
+void CXApp::CountRoundTrip (void) noexcept
+{
+    ++_frameStats.roundTrips;
+    ++_totalStats.roundTrips;
+}
+
+//----------------------------------------------------------------------
+
 CXApp::CXApp (void)
 :_ksyms()
 ,_pconn (nullptr)
@@ -41,6 +87,14 @@ CXApp::CXApp (void)
 ,_glyphpen (XCB_NONE)
 ,_pencolor (0)
 ,_xgc (XCB_NONE)
+,_timerDue (0)
+,_frameStats()
+,_lastFrameStats()
+,_totalStats()
+,_nFrames (0)
+,_trace()
+,_nTrace (0)
+,_traceDropped (0)
 ,_width()
 ,_height()
 ,_winWidth()
@@ -48,6 +102,7 @@ CXApp::CXApp (void)
 ,_minKeycode()
 ,_keysymsPerKeycode()
 ,_wantQuit (false)
+,_tracing (false)
 {
     // Initialize cleanup handlers
     static const int8_t c_Signals[] = {
@@ -57,7 +112,11 @@ CXApp::CXApp (void)
     for (auto i = 0u; i < size(c_Signals); ++ i)
 	signal (c_Signals[i], OnSignal);
     std::set_terminate (Terminate);
+}
 
+/// Connects to the X server. Until then, Update does nothing, so game logic can run headless.
+void CXApp::Connect (void)
+{
     // Establish X server connection
     if (!(_pconn = xcb_connect (nullptr, nullptr)))
 	throw runtime_error ("unable to connect to the X server");
@@ -68,6 +127,8 @@ CXApp::CXApp (void)
     // Request RENDER extension, keyboard mappings, and WM atoms
     auto kbcookie = xcb_get_keyboard_mapping (_pconn, xsetup->min_keycode, xsetup->max_keycode-xsetup->min_keycode);
     auto rendcook = xcb_render_query_version (_pconn, XCB_RENDER_MAJOR_VERSION, XCB_RENDER_MINOR_VERSION);
+    CountRequest (SXStats::xs_Other, c_GetKeyboardMappingReqSize);
+    CountRequest (SXStats::xs_Other, c_QueryVersionReqSize);
     //{{{ Atom name strings, parallel to EXAtoms enum in header
     static const char* c_AtomNames[xa_Count] = {
 	"CARDINAL",
@@ -83,11 +144,15 @@ CXApp::CXApp (void)
 	"_NET_WM_WINDOW_TYPE_NORMAL"
     };
     //}}}
-    for (auto i = 0u; i < size(c_AtomNames); ++i)
+    for (auto i = 0u; i < size(c_AtomNames); ++i) {
 	_atoms[i] = xcb_intern_atom (_pconn, false, strlen(c_AtomNames[i]), c_AtomNames[i]).sequence;
+	CountRequest (SXStats::xs_Other, c_InternAtomReqSize+Pad4(strlen(c_AtomNames[i])));
+    }
 
-    // Receive and store keyboard mappings
+    // Receive and store keyboard mappings. All the requests above were
+    // sent together, so their replies take a single round trip.
     auto kbreply = xcb_get_keyboard_mapping_reply (_pconn, kbcookie, nullptr);
+    CountRoundTrip();
     auto szkeysyms = xcb_get_keyboard_mapping_keysyms_length (kbreply);
     auto psyms = (const wchar_t*) xcb_get_keyboard_mapping_keysyms (kbreply);
     _ksyms.assign (psyms, psyms + szkeysyms);
@@ -110,7 +175,9 @@ CXApp::CXApp (void)
     }
     // Get standard RENDER formats
     auto qpfcook = xcb_render_query_pict_formats (_pconn);
+    CountRequest (SXStats::xs_Other, c_QueryPictFormatsReqSize);
     auto qpfr = xcb_render_query_pict_formats_reply (_pconn, qpfcook, nullptr);
+    CountRoundTrip();
     for (auto i = xcb_render_query_pict_formats_formats_iterator(qpfr); i.rem; xcb_render_pictforminfo_next(&i)) {
 	if (i.data->depth == _pscreen->root_depth && i.data->direct.red_mask == visual->red_mask >> i.data->direct.red_shift)
 	    _xrfmt[rfmt_Default] = i.data->id;
@@ -135,24 +202,125 @@ CXApp::~CXApp (void) noexcept
 int CXApp::Run (void)
 {
     _wantQuit = false;
-    for (xcb_generic_event_t* e; !_wantQuit && xcb_flush(_pconn)>0 && (e = xcb_wait_for_event(_pconn)); free(e)) {
+    while (!_wantQuit && xcb_flush(_pconn) > 0) {
+	xcb_generic_event_t* e;
+	if (!_timerDue) {
+	    if (!(e = xcb_wait_for_event (_pconn)))
+		break;
+	} else if (!(e = xcb_poll_for_event (_pconn))) {
+	    // No events queued, so wait for one until the timer is due
+	    auto now = NowMS();
+	    if (now >= _timerDue) {
+		_timerDue = 0;
+		OnTimer();
+	    } else {
+		pollfd pfd = { xcb_get_file_descriptor (_pconn), POLLIN, 0 };
+		poll (&pfd, 1, _timerDue - now);
+	    }
+	    continue;
+	}
 	switch (e->response_type & 0x7f) {
 	    case XCB_MAP_NOTIFY:	OnMap(); break;
 	    case XCB_EXPOSE:		Update(); break;
 	    case XCB_CONFIGURE_NOTIFY:	OnResize(e); break;
-	    case XCB_KEY_PRESS:		OnKey (TranslateKeycode(e)); break;
+	    case XCB_KEY_PRESS:		OnKeyPress(e); break;
+	    case XCB_BUTTON_PRESS:	OnButtonPress(e); break;
 	    case XCB_CLIENT_MESSAGE:	OnClientMessage(e); break;
 	}
+	free (e);
     }
     return EXIT_SUCCESS;
 }
 
+/// Waits until the server has processed all requests sent so far
+void CXApp::Sync (void) noexcept
+{
+    // Any request with a reply works, since the server handles them in order
+    free (xcb_get_input_focus_reply (_pconn, xcb_get_input_focus (_pconn), nullptr));
+    CountRequest (SXStats::xs_Other, c_GetInputFocusReqSize);
+    CountRoundTrip();
+}
+
+/// Returns monotonic time in microseconds
+uint64_t CXApp::NowUS (void) noexcept
+{
+    timespec t;
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000ull + t.tv_nsec/1000;
+}
+
 void CXApp::Update (void)
 {
     if (!_pconn || !_window)
 	return;
-    OnDraw();
-    xcb_render_composite (_pconn, XCB_RENDER_PICT_OP_SRC, _bpict, XCB_NONE, _wpict, 0, 0, 0, 0, 0, 0, _winWidth, _winHeight);
+    auto t0 = NowUS();
+    { CTraceSpan span (*this, "OnDraw"); OnDraw(); }
+    {
+	CTraceSpan span (*this, "Composite");
+	xcb_render_composite (_pconn, XCB_RENDER_PICT_OP_SRC, _bpict, XCB_NONE, _wpict, 0, 0, 0, 0, 0, 0, _winWidth, _winHeight);
+	CountRequest (SXStats::xs_Composite, c_CompositeReqSize);
+    }
+    _frameStats.drawTime = NowUS() - t0;
+    if (_tracing) {
+	CTraceSpan span (*this, "ServerAck");
+	Sync();
+    }
+    _totalStats.drawTime += _frameStats.drawTime;
+    _lastFrameStats = _frameStats;
+    _frameStats = SXStats();	// Requests made between frames, by resizing or loading fonts, count toward the next one
+    ++_nFrames;
+}
+
+//----------------------------------------------------------------------
+// Latency tracing
+//----------------------------------------------------------------------
+
+/// Starts recording trace spans. Each frame then waits for the server.
+void CXApp::StartTrace (void)
+{
+    _tracing = true;
+    _trace.resize (c_TraceCapacity);	// to keep allocation and page faults out of the measurements
+}
+
+/// Writes recorded spans in the Chrome trace event format, for chrome://tracing or Perfetto
+void CXApp::WriteTrace (FILE* f) const noexcept
+{
+    fprintf (f, "{\"traceEvents\":[");
+    for (auto i = 0u; i < _nTrace; ++i)
+	fprintf (f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":%d,\"tid\":1}", i ? "," : "",
+		_trace[i].name, (unsigned long long) _trace[i].start, _trace[i].duration, getpid());
+    fprintf (f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+}
+
+/// Prints duration percentiles of the named spans
+void CXApp::PrintLatency (const char* spanName) const
+{
+    if (_traceDropped)
+	printf ("Trace buffer full, %u spans dropped\n", _traceDropped);
+    vector<uint32_t> d;
+    for (auto i = 0u; i < _nTrace; ++i)
+	if (!strcmp (_trace[i].name, spanName))
+	    d.push_back (_trace[i].duration);
+    if (d.empty())
+	return;
+    sort (d.begin(), d.end());
+    printf ("%s latency in us: p50 %u, p90 %u, p99 %u, max %u, n %zu\n", spanName,
+	    d[d.size()/2], d[d.size()*9/10], d[d.size()*99/100], d.back(), d.size());
+}
+
+/// Writes request totals and the last frame as JSON
+void CXApp::WriteStats (FILE* f) const noexcept
+{
+    static const char* c_KindNames[SXStats::xs_Kinds] = { "composite", "glyphs", "fill", "upload", "other" };
+    const SXStats* stats[] = { &_totalStats, &_lastFrameStats };
+    fprintf (f, "{\"frames\":%u", _nFrames);
+    for (auto i = 0u; i < size(stats); ++i) {
+	fprintf (f, ",\"%s\":{\"roundTrips\":%u,\"drawTimeUs\":%u", i ? "lastFrame" : "total", stats[i]->roundTrips, stats[i]->drawTime);
+	for (auto k = 0u; k < SXStats::xs_Kinds; ++k)
+	    fprintf (f, ",\"%s\":{\"requests\":%u,\"bytes\":%u}", c_KindNames[k], stats[i]->requests[k], stats[i]->bytes[k]);
+	fprintf (f, "}");
+    }
+    fprintf (f, "}\n");
 }
 
 //----------------------------------------------------------------------
@@ -165,12 +333,13 @@ void CXApp::CreateWindow (const char* title, int width, int height) noexcept
     // Create the window with given dimensions
     static const uint32_t winvals[] = {
 	XCB_NONE,	// XCB_CW_BACK_PIXMAP set to none avoids startup flicker by not drawing background
-	XCB_EVENT_MASK_EXPOSURE| XCB_EVENT_MASK_KEY_PRESS| XCB_EVENT_MASK_STRUCTURE_NOTIFY
+	XCB_EVENT_MASK_EXPOSURE| XCB_EVENT_MASK_KEY_PRESS| XCB_EVENT_MASK_BUTTON_PRESS| XCB_EVENT_MASK_STRUCTURE_NOTIFY
     };
     xcb_create_window (_pconn, XCB_COPY_FROM_PARENT, _window=xcb_generate_id(_pconn),
 	    _pscreen->root, 0, 0, _winWidth = width, _winHeight = height, 0,
 	    XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT,
 	    XCB_CW_BACK_PIXMAP| XCB_CW_EVENT_MASK, winvals);
+    CountRequest (SXStats::xs_Other, c_CreateWindowReqSize+sizeof(winvals));
 
     // Create backing pixmap and the render picture on top of it
     auto bpixid = xcb_generate_id(_pconn);
@@ -179,6 +348,11 @@ void CXApp::CreateWindow (const char* title, int width, int height) noexcept
     xcb_render_create_picture (_pconn, _bpict = xcb_generate_id(_pconn), bpixid, _xrfmt[rfmt_Pixmap], 0, nullptr);
     xcb_free_pixmap (_pconn, bpixid);	// henceforth accessed only through _bpict
     xcb_render_create_picture (_pconn, _wpict = xcb_generate_id(_pconn), _window, _xrfmt[rfmt_Default], 0, nullptr);
+    CountRequest (SXStats::xs_Upload, c_CreatePixmapReqSize);
+    CountRequest (SXStats::xs_Upload, c_CreateGCReqSize);
+    CountRequest (SXStats::xs_Upload, c_CreatePictureReqSize);
+    CountRequest (SXStats::xs_Upload, c_FreePixmapReqSize);
+    CountRequest (SXStats::xs_Upload, c_CreatePictureReqSize);
 
     // Set window title
     xcb_change_property (_pconn, XCB_PROP_MODE_REPLACE, _window, _atoms[xa_WM_NAME], _atoms[xa_STRING], 8, strlen(title), title);
@@ -191,8 +365,12 @@ void CXApp::CreateWindow (const char* title, int width, int height) noexcept
     xcb_change_property (_pconn, XCB_PROP_MODE_REPLACE, _window, _atoms[xa_NET_WM_STATE], _atoms[xa_ATOM], 32, 1, &_atoms[xa_NET_WM_STATE_FULLSCREEN]);
     // Set window type
     xcb_change_property (_pconn, XCB_PROP_MODE_REPLACE, _window, _atoms[xa_NET_WM_WINDOW_TYPE], _atoms[xa_ATOM], 32, 1, &_atoms[xa_NET_WM_WINDOW_TYPE_NORMAL]);
+    CountRequest (SXStats::xs_Other, c_ChangePropertyReqSize+Pad4(strlen(title)));
+    for (auto i = 0u; i < 4; ++i)	// the four single value properties
+	CountRequest (SXStats::xs_Other, c_ChangePropertyReqSize+4);
     // And put it on the screen
     xcb_map_window (_pconn, _window);
+    CountRequest (SXStats::xs_Other, c_MapWindowReqSize);
 }
 
 void CXApp::OnMap (void) noexcept
@@ -211,6 +389,7 @@ void CXApp::OnResize (const void* e) noexcept
     tr.matrix22 = (_height<<16)/_winHeight;
     tr.matrix33 = (1<<16);
     xcb_render_set_picture_transform (_pconn, _bpict, tr);
+    CountRequest (SXStats::xs_Other, c_SetPictureTransformReqSize);
 }
 
 void CXApp::OnClientMessage (const void* e) noexcept
@@ -221,12 +400,33 @@ void CXApp::OnClientMessage (const void* e) noexcept
 	Quit();
 }
 
+// The KeyPress span covers everything up to the server acknowledging the frame
+void CXApp::OnKeyPress (const void* e) noexcept
+{
+    CTraceSpan keyspan (*this, "KeyPress");
+    key_t key;
+    {
+	CTraceSpan span (*this, "TranslateKeycode");
+	key = TranslateKeycode (e);
+    }
+    CTraceSpan span (*this, "OnKey");
+    OnKey (key);
+}
+
 wchar_t CXApp::TranslateKeycode (const void* event) const noexcept
 {
     auto kp = reinterpret_cast<const xcb_key_press_event_t*>(event);
     return _ksyms[(kp->detail-_minKeycode)*_keysymsPerKeycode];
 }
 
+// Button coordinates are scaled from the window to the backbuffer
+void CXApp::OnButtonPress (const void* event) noexcept
+{
+    auto bp = reinterpret_cast<const xcb_button_press_event_t*>(event);
+    if (_winWidth && _winHeight)
+	OnButton (bp->detail, bp->event_x*_width/_winWidth, bp->event_y*_height/_winHeight);
+}
+
 CXApp::SImage CXApp::LoadImage (const char* const* p) noexcept
 {
     SImage img;
@@ -248,17 +448,30 @@ CXApp::SImage CXApp::LoadImage (const char* const* p) noexcept
     xcb_put_image (_pconn, XCB_IMAGE_FORMAT_Z_PIXMAP, pixid, _xgc, img.w, img.h, 0, 0, 0, 32, pixels.size()*4, (const uint8_t*) &pixels[0]);
     xcb_render_create_picture (_pconn, img.id = xcb_generate_id(_pconn), pixid, _xrfmt[rfmt_Pixmap], 0, nullptr);
     xcb_free_pixmap (_pconn, pixid);
+    CountRequest (SXStats::xs_Upload, c_CreatePixmapReqSize);
+    CountRequest (SXStats::xs_Upload, c_PutImageReqSize+pixels.size()*4);
+    CountRequest (SXStats::xs_Upload, c_CreatePictureReqSize);
+    CountRequest (SXStats::xs_Upload, c_FreePixmapReqSize);
     return img;
 }
 
+void CXApp::FreeImage (const SImage& img) noexcept
+{
+    xcb_render_free_picture (_pconn, img.id);
+    CountRequest (SXStats::xs_Upload, c_FreePictureReqSize);
+}
+
 void CXApp::DrawImageTile (const SImage& img, const SImageTile& tile, int x, int y) noexcept
 {
     xcb_render_composite (_pconn, XCB_RENDER_PICT_OP_OVER, img.id, XCB_NONE, _bpict, tile.x, tile.y, 0, 0, x, y, tile.w, tile.h);
+    CountRequest (SXStats::xs_Composite, c_CompositeReqSize);
 }
 
 void CXApp::LoadFont (void) noexcept
 {
+    FreeFont();
     xcb_render_create_glyph_set (_pconn, _glyphset = xcb_generate_id(_pconn), _xrfmt[rfmt_Font]);
+    CountRequest (SXStats::xs_Upload, c_CreateGlyphSetReqSize);
     static const xcb_render_glyphinfo_t glyphi[] = {
 	{ 4, 6, 0, 0, 4, 0 },
 	{ 4, 6, 0, 0, 4, 0 },
@@ -281,18 +494,34 @@ void CXApp::LoadFont (void) noexcept
 	    glid[0] = row*16+col*2;
 	    glid[1] = row*16+col*2+1;
 	    xcb_render_add_glyphs (_pconn, _glyphset, 2, glid, glyphi, sizeof(lbuf), lbuf);
+	    CountRequest (SXStats::xs_Upload, c_AddGlyphsReqSize+size(glid)*16+sizeof(lbuf));
 	}
     }
     uint32_t repeatOn = 1, pixid = xcb_generate_id(_pconn);
     xcb_create_pixmap (_pconn, 32, pixid, _window, 1, 1);
     xcb_render_create_picture (_pconn, _glyphpen = xcb_generate_id(_pconn), pixid, _xrfmt[rfmt_Pixmap], XCB_RENDER_CP_REPEAT, &repeatOn);
     xcb_free_pixmap (_pconn, pixid);
+    CountRequest (SXStats::xs_Upload, c_CreatePixmapReqSize);
+    CountRequest (SXStats::xs_Upload, c_CreatePictureReqSize+4);
+    CountRequest (SXStats::xs_Upload, c_FreePixmapReqSize);
     static const xcb_rectangle_t r = { 0, 0, 1, 1 };
     static const xcb_render_color_t rc = { 0, 0, 0, 0xffff };
     xcb_render_fill_rectangles (_pconn, XCB_RENDER_PICT_OP_SRC, _glyphpen, rc, 1, &r);
+    CountRequest (SXStats::xs_Fill, c_FillRectanglesReqSize+8);
     _pencolor = 0;
 }
 
+void CXApp::FreeFont (void) noexcept
+{
+    if (_glyphset == XCB_NONE)
+	return;
+    xcb_render_free_glyph_set (_pconn, _glyphset);
+    xcb_render_free_picture (_pconn, _glyphpen);
+    CountRequest (SXStats::xs_Upload, c_FreeGlyphSetReqSize);
+    CountRequest (SXStats::xs_Upload, c_FreePictureReqSize);
+    _glyphset = _glyphpen = XCB_NONE;
+}
+
 void CXApp::DrawText (int x, int y, const char* s, uint32_t color) noexcept
 {
     if (color != _pencolor) {
@@ -303,6 +532,7 @@ void CXApp::DrawText (int x, int y, const char* s, uint32_t color) noexcept
 	rc.alpha = ((color>>24)&0xff00)^0xff00;	// ... and thinks that "alpha" means "opacity" instead of "transparency"
 	static const xcb_rectangle_t r = { 0, 0, 1, 1 };
 	xcb_render_fill_rectangles (_pconn, XCB_RENDER_PICT_OP_SRC, _glyphpen, rc, 1, &r);
+	CountRequest (SXStats::xs_Fill, c_FillRectanglesReqSize+8);
 	_pencolor = color;
     }
     struct TextElement {	// For some reason, render_glyphs call takes a list of these instead of a plain text string
@@ -319,4 +549,5 @@ void CXApp::DrawText (int x, int y, const char* s, uint32_t color) noexcept
     memcpy (elt.text, s, slen);
     uint8_t eltsz = 8+((slen+3)&~3u);			// This is the size of the header elements + the text padded to 4 byte grain
     xcb_render_composite_glyphs_8 (_pconn, XCB_RENDER_PICT_OP_OVER, _glyphpen, _bpict, XCB_NONE, _glyphset, 0, 0, eltsz, &elt.len);
+    CountRequest (SXStats::xs_Glyphs, c_CompositeGlyphsReqSize+eltsz);
 }
@@ -22,6 +22,39 @@ public:
     struct SImageTile {
 	uint8_t		x,y,w,h;
     };
+    /// X request counters for profiling the drawing code
+    struct SXStats {
+	enum EKind {
+	    xs_Composite,	///< DrawImageTile and the backbuffer copy
+	    xs_Glyphs,		///< DrawText glyph runs
+	    xs_Fill,		///< Rectangle fills
+	    xs_Upload,		///< Image, font, and resource creation and release
+	    xs_Other,		///< Window setup, queries, and syncs
+	    xs_Kinds
+	};
+	uint32_t	requests [xs_Kinds];
+	uint32_t	bytes [xs_Kinds];	///< Request size on the wire
+	uint32_t	roundTrips;		///< Waits for a batch of replies
+	uint32_t	drawTime;		///< In OnDraw and the backbuffer copy, in microseconds
+    };
+    /// Trace event, written in Chrome trace format
+    struct STraceEvent {
+	const char*	name;
+	uint64_t	start;		///< NowUS at the start of the span
+	uint32_t	duration;
+    };
+    /// Times the enclosing scope into the trace, when tracing is enabled
+    class CTraceSpan {
+    public:
+	inline		CTraceSpan (CXApp& app, const char* name) noexcept : _app (app), _name (name), _start (app._tracing ? NowUS() : 0) {}
+	inline		~CTraceSpan (void) noexcept	{ if (_start) _app.AddTraceEvent (_name, _start); }
+			CTraceSpan (const CTraceSpan&) = delete;
+	void		operator= (const CTraceSpan&) = delete;
+    private:
+	CXApp&		_app;
+	const char*	_name;
+	uint64_t	_start;
+    };
     enum {
 	_XKM_Bitshift	= 24,
 	XKM_Shift	= 1<<_XKM_Bitshift,
@@ -32,7 +65,14 @@ public:
 public:
     inline void			Quit (void)	{ OnQuit(); }
     void			Update (void);
+    void			Sync (void) noexcept;
     int				Run (void);
+    static uint64_t		NowUS (void) noexcept;
+    static inline uint64_t	NowMS (void) noexcept			{ return NowUS()/1000; }
+    void			WriteStats (FILE* f) const noexcept;
+    void			StartTrace (void);
+    void			WriteTrace (FILE* f) const noexcept;
+    void			PrintLatency (const char* spanName) const;
 protected:
 				CXApp (void);
     virtual			~CXApp (void) noexcept;
@@ -40,14 +80,23 @@ protected:
     inline virtual void		OnDraw (void)	{ }
     inline virtual void		OnQuit (void)	{ _wantQuit = true; }
     inline virtual void		OnKey (key_t)	{ }
+    inline virtual void		OnButton (bidx_t, int, int)	{ }
+    inline virtual void		OnTimer (void)	{ }
+    inline void			SetTimer (uint32_t ms) noexcept		{ _timerDue = NowMS() + ms; }
     inline uint16_t		Width (void) const			{ return _width; }
     inline uint16_t		Height (void) const			{ return _height; }
+    inline const SXStats&	FrameStats (void) const			{ return _lastFrameStats; }
     static constexpr uint32_t	RGB (uint8_t r, uint8_t g, uint8_t b)	{ return r<<16|g<<8|b; }
     SImage			LoadImage (const char* const* p) noexcept;
+    void			FreeImage (const SImage& img) noexcept;
     void			DrawImageTile (const SImage& img, const SImageTile& tile, int x, int y) noexcept;
+    void			Connect (void);
     void			CreateWindow (const char* title, int w, int h) noexcept;
     void			DrawText (int x, int y, const char* s, uint32_t color) noexcept;
+    void			LoadFont (void) noexcept;
+    void			FreeFont (void) noexcept;
 private:
+    enum { c_TraceCapacity = 1<<18 };
     enum EXRFmt {
 	rfmt_Default,
 	rfmt_Bitmask,
@@ -71,9 +120,15 @@ private:
 private:
     inline void			OnMap (void) noexcept;
     inline void			OnResize (const void* event) noexcept;
+    inline void			OnKeyPress (const void* event) noexcept;
     inline wchar_t		TranslateKeycode (const void* event) const noexcept;
+    inline void			OnButtonPress (const void* event) noexcept;
     inline void			OnClientMessage (const void* e) noexcept;
-    void			LoadFont (void) noexcept;
+    inline void			CountRequest (SXStats::EKind k, uint32_t bytes) noexcept;
+    inline void			CountRoundTrip (void) noexcept;
+    /// Events past the preallocated capacity are dropped, so recording never allocates
+    inline void			AddTraceEvent (const char* name, uint64_t start) noexcept
+				    { if (_nTrace < _trace.size()) _trace[_nTrace++] = { name, start, uint32_t(NowUS()-start) }; else ++_traceDropped; }
 private:
     vector<wchar_t>		_ksyms;
     xcb_connection_t*		_pconn;
@@ -86,6 +141,14 @@ private:
     uint32_t			_pencolor;
     uint32_t			_xgc;
     uint32_t			_atoms [xa_Count];
+    uint64_t			_timerDue;	///< NowMS time to call OnTimer, 0 if none
+    SXStats			_frameStats;	///< Requests since the end of the last frame
+    SXStats			_lastFrameStats;	///< Including requests made before it since the previous frame
+    SXStats			_totalStats;
+    uint32_t			_nFrames;
+    vector<STraceEvent>		_trace;		///< Sized once by StartTrace
+    uint32_t			_nTrace;
+    uint32_t			_traceDropped;
     uint16_t			_xrfmt [4];
     uint16_t			_width;
     uint16_t			_height;
@@ -94,6 +157,7 @@ private:
     uint8_t			_minKeycode;
     uint8_t			_keysymsPerKeycode;
     bool			_wantQuit;
+    bool			_tracing;
 };
 
 //----------------------------------------------------------------------
@@ -101,10 +165,10 @@ private:
 extern "C" void InstallCleanupHandlers (void);
 
 template <typename AppClass>
-inline int TMainApp (int, const char* const*)
+inline int TMainApp (int argc, const char* const* argv)
 {
     try {
-	return AppClass::Instance().Run();
+	return AppClass::Instance().Run (argc, argv);
     } catch (exception& e) {
 	printf ("Error: %s\n", e.what());
     }